@@ -2,6 +2,13 @@
 #include <fstream>
 #include <array>
 #include <vector>
+#include <string>
+#include <cstdio>
+#include <algorithm>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 using namespace std;
 
@@ -10,30 +17,31 @@ class Bitmap {
     private:
 
         vector<char> currentImg = {};
-        vector<int> currentHist = {};
+        vector<uint64_t> currentHist = {};
         int32_t dataOffset;
         int32_t height = 0;
         int32_t width = 0;
-        int totalPvalue = 0;
+        int64_t totalPvalue = 0;
 
-        void updateCurrentImg(vector<char> img) {
-            currentImg = img;
-            dataOffset = *reinterpret_cast<int32_t *>(&img[10]);
-            width = *reinterpret_cast<int32_t *>(&img[18]);
-            height = *reinterpret_cast<int32_t *>(&img[22]);
+        void updateCurrentImg(vector<char> && img) {
+            currentImg = move(img);
+            dataOffset = *reinterpret_cast<int32_t *>(&currentImg[10]);
+            width = *reinterpret_cast<int32_t *>(&currentImg[18]);
+            height = *reinterpret_cast<int32_t *>(&currentImg[22]);
 
-            for(auto i = dataOffset; i < img.size(); i += 3) {
-                totalPvalue += img[i];
+            totalPvalue = 0;
+            for(size_t i = dataOffset; i < currentImg.size(); i += 3) {
+                totalPvalue += int(currentImg[i] & 0xff);
             }
 
-            setHistogram(img);
+            setHistogram(currentImg);
             return;
         }
 
-        void setHistogram(vector<char> img) {
-            vector<int> hist(256);
+        void setHistogram(const vector<char> & img) {
+            vector<uint64_t> hist(256);
 
-            for (int i = dataOffset; i < img.size(); i+= 3) {
+            for (size_t i = dataOffset; i < img.size(); i+= 3) {
                 hist[int(img[i] & 0xff)] += 1;
             }
 
@@ -60,7 +68,7 @@ class Bitmap {
             auto width = *reinterpret_cast<uint32_t *>(&header[18]);
             auto height = *reinterpret_cast<uint32_t *>(&header[22]);
 
-            auto dataSize = (dataOffset + ((width * height) * 3));
+            size_t dataSize = dataOffset + (size_t(width) * height * 3);
             vector<char> img(dataSize);
             
             imageFile.seekg(0, ios::beg);
@@ -71,18 +79,46 @@ class Bitmap {
 
         }
 
-        void writeFile(vector<char> img) {
-            ofstream grayscaleImage;
-            grayscaleImage.open("grayscale.bmp", ios::out | ios::binary);
+        void writeFile(const vector<char> & img, string filename) {
+            // Nothing to write until an image with a full header has been loaded.
+            if (img.size() < 54) {
+                cout << "Unable to write to file." << endl;
+                return;
+            }
+
+            // Write to a temporary file next to the target and rename it over the target.
+            string tempName = filename + ".tmp";
+            int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-            if(!grayscaleImage.is_open()) {
+            if(fd < 0) {
                 cout << "Unable to write to file." << endl;
                 return;
             }
 
-            grayscaleImage.write(img.data(), img.size());
-            grayscaleImage.close();
+            // Write the header and the pixel array with one writev, continuing after a partial write.
+            size_t headerSize = min<size_t>(*reinterpret_cast<const uint32_t *>(&img[10]), img.size());
+            struct iovec iov[2] = {{const_cast<char *>(img.data()), headerSize},
+                                   {const_cast<char *>(img.data()) + headerSize, img.size() - headerSize}};
+            int next = 0;
+            bool failed = false;
+            while (next < 2 && !failed) {
+                ssize_t written = writev(fd, &iov[next], 2 - next);
+                failed = written < 0;
+                while (!failed && next < 2 && size_t(written) >= iov[next].iov_len) {
+                    written -= iov[next].iov_len;
+                    next++;
+                }
+                if (!failed && written > 0) {
+                    iov[next].iov_base = static_cast<char *>(iov[next].iov_base) + written;
+                    iov[next].iov_len -= written;
+                }
+            }
+            failed = (close(fd) != 0) || failed;
 
+            if (failed || rename(tempName.c_str(), filename.c_str()) != 0) {
+                cout << "Unable to write to file." << endl;
+                remove(tempName.c_str());
+            }
             return;
         }
 
@@ -98,7 +134,7 @@ class Bitmap {
 
             auto dataOffset = *reinterpret_cast<uint32_t *>(&img[10]);
 
-            for (auto i = dataOffset; i < img.size(); i += 3) {
+            for (size_t i = dataOffset; i < img.size(); i += 3) {
                 int grayValue = (int(img[i] & 0xff) * 0.0722) +
                                 (int(img[i+1] & 0xff) * 0.7152) +
                                 (int(img[i+2] & 0xff) * 0.2126);
@@ -107,8 +143,8 @@ class Bitmap {
                 img[i+2] = grayValue;
             }
             
-            writeFile(img);
-            updateCurrentImg(img);
+            writeFile(img, "grayscale.bmp");
+            updateCurrentImg(move(img));
             cout << "Grayscale Image created. " << endl;
             return;
         }
@@ -118,27 +154,27 @@ class Bitmap {
             vector<char> img = currentImg;
 
             if (amt >= 100) {
-                for (auto i = dataOffset; i < img.size(); i += 3) {
+                for (size_t i = dataOffset; i < img.size(); i += 3) {
                     img[i] = 0xff;
                     img[i+1] = 0xff;
                     img[i+2] = 0xff;
                 }
-                writeFile(img);
+                writeFile(img, "grayscale.bmp");
             } else if (amt <= 0) {
-                for (auto i = dataOffset; i < img.size(); i += 3) {
+                for (size_t i = dataOffset; i < img.size(); i += 3) {
                     img[i] = 0x00;
                     img[i+1] = 0x00;
                     img[i+2] = 0x00;
                 }
-                writeFile(img);
+                writeFile(img, "grayscale.bmp");
             } else {
-                amt = ((amt * 2.55) * (height * width));
-                int expectedTotal = amt;
-                int total = totalPvalue;
-                while (amt != 0) {
-                    amt = ((expectedTotal - total) / (height * width));
+                int64_t pixels = int64_t(height) * width;
+                int64_t expectedTotal = (amt * 2.55) * pixels;
+                int64_t total = totalPvalue;
+                while (amt != 0 && pixels > 0) {
+                    amt = ((expectedTotal - total) / pixels);
                     total = 0;
-                    for (auto i = dataOffset; i < img.size(); i += 3) {
+                    for (size_t i = dataOffset; i < img.size(); i += 3) {
                         if ((int(img[i] & 0xff) + amt) > 255) {
                             img[i] = 0xff;
                             img[i+1] = 0xff;
@@ -157,7 +193,7 @@ class Bitmap {
                 }
             }
 
-            writeFile(img);
+            writeFile(img, "grayscale.bmp");
             setHistogram(img);
             return;
 
@@ -166,7 +202,7 @@ class Bitmap {
         void clamp(int low, int high) {
             vector<char> img = currentImg;
 
-            for (int i = dataOffset; i < img.size(); i += 3) {
+            for (size_t i = dataOffset; i < img.size(); i += 3) {
                 if ((int(img[i] & 0xff) < low)) {
                     img[i] = low;
                     img[i + 1] = low;
@@ -178,7 +214,7 @@ class Bitmap {
                 }
             }
 
-            writeFile(img);
+            writeFile(img, "grayscale.bmp");
             setHistogram(img);
             return;
         }
@@ -186,7 +222,7 @@ class Bitmap {
         void intensityWindow(int low, int high) {
             vector<char> img = currentImg;
 
-            for (int i = dataOffset; i < img.size(); i += 3) {
+            for (size_t i = dataOffset; i < img.size(); i += 3) {
                 if ((int(img[i] & 0xff) < low)) {
                     img[i] = 0x00;
                     img[i + 1] = 0x00;
@@ -204,15 +240,18 @@ class Bitmap {
                 }
             }
 
-            writeFile(img);
+            writeFile(img, "grayscale.bmp");
             setHistogram(img);
             return;
         }
 
         void getHistogram() {
-            int increment = (width * height) / 10;
-            int totalValue = 0;
-             for (int i = 0; i < currentHist.size(); i += 5) {
+            uint64_t increment = (uint64_t(width) * height) / 10;
+            if (increment == 0) {
+                increment = 1;
+            }
+            uint64_t totalValue = 0;
+             for (size_t i = 0; i < currentHist.size(); i += 5) {
                 cout << i << " | ";
                 totalValue += currentHist[i];
                 if (i < 255) {
@@ -221,7 +260,7 @@ class Bitmap {
                     totalValue += currentHist[i+3];
                     totalValue += currentHist[i+4];
                 }
-                for(int j = 0; j < totalValue; j += increment){
+                for(uint64_t j = 0; j < totalValue; j += increment){
                     cout << "*";
                 }
                 cout << endl;
@@ -3,6 +3,13 @@
 #include <array>
 #include <vector>
 #include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 /* Otsu provides functionality to turn a bitmap image into a binary image using the
 Otsu threshold method. */
@@ -12,28 +19,35 @@ class Otsu {
 
         // Initialize class variables  
         std::vector<char> currentImg = {};
-        std::vector<int> currentHist = {};
+        std::vector<uint64_t> currentHist = {};
         int32_t dataOffset = 0;
         int32_t height = 0;
         int32_t width = 0;
+        size_t rowStride = 0;
 
         // Update current stored image data.
-        void updateCurrentImg(std::vector<char> img) {
-            currentImg = img;
-            dataOffset = *reinterpret_cast<int32_t *>(&img[10]);
-            width = *reinterpret_cast<int32_t *>(&img[18]);
-            height = *reinterpret_cast<int32_t *>(&img[22]);
-
-            setHistogram(img);
+        void updateCurrentImg(std::vector<char> && img) {
+            currentImg = std::move(img);
+            dataOffset = *reinterpret_cast<int32_t *>(&currentImg[10]);
+            width = *reinterpret_cast<int32_t *>(&currentImg[18]);
+            height = std::abs(*reinterpret_cast<int32_t *>(&currentImg[22]));
+            rowStride = ((size_t(width) * 3) + 3) & ~size_t(3);
+
+            setHistogram();
             return;
         }
 
-        // Creates the histogram of an image
-        void setHistogram(std::vector<char> img) {
-            std::vector<int> hist(256);
+        // Creates the histogram of the currently stored image.
+        void setHistogram() {
+            const std::vector<char> & img = currentImg;
+            std::vector<uint64_t> hist(256);
 
-            for (int i = dataOffset; i <= img.size(); i+= 3) {
-                hist[int(img[i] & 0xff)]++;
+            // Skip the padding at the end of each row.
+            for (int row = 0; row < height; row++) {
+                size_t start = dataOffset + (row * rowStride);
+                for (size_t i = start; i < start + (size_t(width) * 3); i += 3) {
+                    hist[int(img[i] & 0xff)]++;
+                }
             }
 
             currentHist = hist;
@@ -45,8 +59,8 @@ class Otsu {
         int otsuThreshold() {
             
             // Set histogram and total number of pixels.
-            std::vector<int> hist = currentHist;
-            int total = height * width;
+            std::vector<uint64_t> hist = currentHist;
+            uint64_t total = uint64_t(height) * width;
 
             // Retrieve sum value to compute average foreground value
             double sum = 0;
@@ -120,35 +134,77 @@ class Otsu {
             imageFile.read(header.data(), header.size());
 
             auto dataOffset = *reinterpret_cast<uint32_t *>(&header[10]);
-            auto width = *reinterpret_cast<uint32_t *>(&header[18]);
-            auto height = *reinterpret_cast<uint32_t *>(&header[22]);
+            auto width = *reinterpret_cast<int32_t *>(&header[18]);
+            auto height = *reinterpret_cast<int32_t *>(&header[22]);
+            auto depth = *reinterpret_cast<uint16_t *>(&header[28]);
+            auto compression = *reinterpret_cast<uint32_t *>(&header[30]);
+
+            // Only uncompressed 24 bpp images are supported, negative heights mark top-down rows.
+            if (header[0] != 'B' || header[1] != 'M' || depth != 24 || compression != 0 || width <= 0 || height == 0) {
+                std::cout << "Unsupported bitmap format." << std::endl;
+                return {};
+            }
             
-            // Read remaining image file.
-            auto dataSize = (dataOffset + ((width * height) * 3));
+            // Read remaining image file, each row is padded to a multiple of 4 bytes.
+            size_t rowStride = ((size_t(width) * 3) + 3) & ~size_t(3);
+            size_t dataSize = dataOffset + (rowStride * size_t(std::abs(height)));
             std::vector<char> img(dataSize);
             
             imageFile.seekg(0, std::ios::beg);
             imageFile.read(img.data(), img.size());
             
+            // Ensure the whole pixel array was read.
+            if (size_t(imageFile.gcount()) != img.size()) {
+                std::cout << "Unable to read image data." << std::endl;
+                return {};
+            }
+
             imageFile.close();
             return img;
         }
 
         // Writes a bitmap image to a specified file name.
-        void writeFile(std::vector<char> img, std::string filename) {
-            std::ofstream newImage;
-            newImage.open(filename, std::ios::out | std::ios::binary);
+        void writeFile(const std::vector<char> & img, std::string filename) {
+            // Nothing to write until an image with a full header has been loaded.
+            if (img.size() < 54) {
+                std::cout << "Unable to write to file." << std::endl;
+                return;
+            }
+
+            // Write to a temporary file and rename it so readers never see a partial image.
+            std::string tempName = filename + ".tmp";
+            int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
             
             // Ensure file was opened successfully.
-            if(!newImage.is_open()) {
+            if(fd < 0) {
                 std::cout << "Unable to write to file." << std::endl;
                 return;
             }
 
-            // Write image data to the file.
-            newImage.write(img.data(), img.size());
-            newImage.close();
+            // Write the header and the pixel array with one writev, continuing after a partial write.
+            size_t headerSize = std::min<size_t>(*reinterpret_cast<const uint32_t *>(&img[10]), img.size());
+            struct iovec iov[2] = {{const_cast<char *>(img.data()), headerSize},
+                                   {const_cast<char *>(img.data()) + headerSize, img.size() - headerSize}};
+            int next = 0;
+            bool failed = false;
+            while (next < 2 && !failed) {
+                ssize_t written = writev(fd, &iov[next], 2 - next);
+                failed = written < 0;
+                while (!failed && next < 2 && size_t(written) >= iov[next].iov_len) {
+                    written -= iov[next].iov_len;
+                    next++;
+                }
+                if (!failed && written > 0) {
+                    iov[next].iov_base = static_cast<char *>(iov[next].iov_base) + written;
+                    iov[next].iov_len -= written;
+                }
+            }
+            failed = (close(fd) != 0) || failed;
 
+            if (failed || std::rename(tempName.c_str(), filename.c_str()) != 0) {
+                std::cout << "Unable to write to file." << std::endl;
+                std::remove(tempName.c_str());
+            }
             return;
         }
 
@@ -165,40 +221,54 @@ class Otsu {
             }
 
             auto dataOffset = *reinterpret_cast<uint32_t *>(&img[10]);
-
-            // Transform pixels to their greyscale values.
-            for (int i = dataOffset; i < img.size(); i += 3) {
-                int grayValue = (int(img[i] & 0xff) * 0.0722) +
-                                (int(img[i+1] & 0xff) * 0.7152) +
-                                (int(img[i+2] & 0xff) * 0.2126);
-                img[i] = grayValue;
-                img[i+1] = grayValue;
-                img[i+2] = grayValue;
+            auto width = *reinterpret_cast<int32_t *>(&img[18]);
+            auto height = std::abs(*reinterpret_cast<int32_t *>(&img[22]));
+            size_t rowStride = ((size_t(width) * 3) + 3) & ~size_t(3);
+
+            // Transform pixels to their greyscale values, skipping the row padding.
+            for (int row = 0; row < height; row++) {
+                size_t start = dataOffset + (row * rowStride);
+                for (size_t i = start; i < start + (size_t(width) * 3); i += 3) {
+                    int grayValue = (int(img[i] & 0xff) * 0.0722) +
+                                    (int(img[i+1] & 0xff) * 0.7152) +
+                                    (int(img[i+2] & 0xff) * 0.2126);
+                    img[i] = grayValue;
+                    img[i+1] = grayValue;
+                    img[i+2] = grayValue;
+                }
             }
             
             // Write the greyscale image to "grayscale.bmp" and update the currently stored image.
             writeFile(img, "grayscale.bmp");
-            updateCurrentImg(img);
+            updateCurrentImg(std::move(img));
             std::cout << "Grayscale Image created. " << std::endl;
             return;
         }
 
         // Create a binary version of the currently sotred image.
         void createBinary() {
+            // Ensure an image has been loaded.
+            if (currentImg.size() == 0) {
+                return;
+            }
+
             // Retrieve threshold value from otsuThreshold().
             int threshold = otsuThreshold();
             std::vector<char> img = currentImg;
 
-            // Set binary values based on threshold value.
-            for(int i = dataOffset; i < img.size(); i += 3) {
-                if (int(img[i] & 0xff) <= threshold) {
-                    img[i] = 0x00;
-                    img[i+1] = 0x00;
-                    img[i+2] = 0x00;
-                } else {
-                    img[i] = 0xff;
-                    img[i+1] = 0xff;
-                    img[i+2] = 0xff;
+            // Set binary values based on threshold value, skipping the row padding.
+            for (int row = 0; row < height; row++) {
+                size_t start = dataOffset + (row * rowStride);
+                for(size_t i = start; i < start + (size_t(width) * 3); i += 3) {
+                    if (int(img[i] & 0xff) <= threshold) {
+                        img[i] = 0x00;
+                        img[i+1] = 0x00;
+                        img[i+2] = 0x00;
+                    } else {
+                        img[i] = 0xff;
+                        img[i+1] = 0xff;
+                        img[i+2] = 0xff;
+                    }
                 }
             }
 
@@ -3,410 +3,4647 @@
 #include <array>
 #include <vector>
 #include <string>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <sys/uio.h>
+#include <new>
+#include <exception>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <streambuf>
+#include <cerrno>
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Bitmap compression types understood by the reader.
+static constexpr uint32_t BI_RGB = 0;
+static constexpr uint32_t BI_BITFIELDS = 3;
+static constexpr uint32_t BI_ALPHABITFIELDS = 6;
+
+// Layout of the pixel array described by a bitmap file and info header.
+struct BitmapInfo {
+    uint32_t dataOffset = 0;
+    uint32_t infoSize = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    bool topDown = false;
+    uint16_t bitsPerPixel = 0;
+    uint32_t compression = BI_RGB;
+    size_t rowStride = 0;
+    // BGRA palette entries for 8 bpp images.
+    std::vector<uint32_t> palette = {};
+};
+
+/* BufferPool hands out blocks rounded up to power of two size classes and keeps
+freed blocks for reuse, so repeated jobs do not pay for fresh allocations and page
+faults. Blocks of 2 MB and more are mapped directly and advised to use transparent
+huge pages; their rounding only costs address space, since untouched pages are
+never committed. One pool is shared by all threads. */
+class BufferPool {
+
+    public:
+
+        // Counters for reuse and peak usage.
+        struct Stats {
+            uint64_t requests = 0;
+            uint64_t reused = 0;
+            uint64_t bytesInUse = 0;
+            uint64_t peakBytesInUse = 0;
+            uint64_t bytesCached = 0;
+        };
 
-class Image {
     private:
-        // Initialize class variables 
-        std::vector<char> currentImgHeader = {}; 
-        std::vector< std::vector<char> > currentImgData = {{}};
-        std::vector<int> currentHist = {};
-        int32_t dataOffset = 0;
-        int32_t height = 0;
-        int32_t width = 0;
 
-        bool skeletonComplete = false;
+        static constexpr int MIN_CLASS = 12;
+        static constexpr int MAX_CLASS = 47;
+        static constexpr size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+        std::mutex poolLock;
+        std::vector<void *> freeBlocks[MAX_CLASS + 1];
+        uint64_t maxCachedBytes = uint64_t(1) << 30;
+        Stats counters;
+
+        static int sizeClass(size_t size) {
+            int bits = MIN_CLASS;
+            while (bits < MAX_CLASS && (size_t(1) << bits) < size) {
+                bits++;
+            }
+            return bits;
+        }
+
+        static void * allocateBlock(size_t capacity) {
+            if (capacity < HUGE_PAGE_SIZE) {
+                return ::operator new(capacity, std::align_val_t(64));
+            }
+            void * block = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (block == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(block, capacity, MADV_HUGEPAGE);
+#endif
+            return block;
+        }
+
+        static void freeBlock(void * block, size_t capacity) {
+            if (capacity < HUGE_PAGE_SIZE) {
+                ::operator delete(block, std::align_val_t(64));
+            } else {
+                munmap(block, capacity);
+            }
+        }
+
+    public:
+
+        ~BufferPool() {
+            trim();
+        }
+
+        // Pool shared by every thread in the process.
+        static BufferPool & shared() {
+            static BufferPool pool;
+            return pool;
+        }
+
+        /* Take a block of at least size bytes, capacity is set to its real size. If the
+        allocation throws, capacity is left alone and the counters are put back. Sizes past
+        the largest class throw std::bad_alloc. */
+        void * acquire(size_t size, size_t & capacity) {
+            if (size > (size_t(1) << MAX_CLASS)) {
+                throw std::bad_alloc();
+            }
+            int bits = sizeClass(size);
+            size_t blockSize = size_t(1) << bits;
+            void * block = nullptr;
+            {
+                std::lock_guard<std::mutex> guard(poolLock);
+                counters.requests++;
+                if (!freeBlocks[bits].empty()) {
+                    block = freeBlocks[bits].back();
+                    freeBlocks[bits].pop_back();
+                    counters.reused++;
+                    counters.bytesCached -= blockSize;
+                }
+                counters.bytesInUse += blockSize;
+                counters.peakBytesInUse = std::max(counters.peakBytesInUse, counters.bytesInUse);
+            }
+            if (block == nullptr) {
+                try {
+                    block = allocateBlock(blockSize);
+                } catch (const std::bad_alloc &) {
+                    std::lock_guard<std::mutex> guard(poolLock);
+                    counters.bytesInUse -= blockSize;
+                    throw;
+                }
+            }
+            capacity = blockSize;
+            return block;
+        }
+
+        // Return a block, it is kept for reuse unless the pool already caches too much.
+        void release(void * block, size_t capacity) {
+            if (block == nullptr) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> guard(poolLock);
+                counters.bytesInUse -= capacity;
+                if (counters.bytesCached + capacity <= maxCachedBytes) {
+                    freeBlocks[sizeClass(capacity)].push_back(block);
+                    counters.bytesCached += capacity;
+                    return;
+                }
+            }
+            freeBlock(block, capacity);
+        }
+
+        // Free every cached block.
+        void trim() {
+            std::lock_guard<std::mutex> guard(poolLock);
+            for (int bits = MIN_CLASS; bits <= MAX_CLASS; bits++) {
+                for (size_t i = 0; i < freeBlocks[bits].size(); i++) {
+                    freeBlock(freeBlocks[bits][i], size_t(1) << bits);
+                }
+                freeBlocks[bits].clear();
+            }
+            counters.bytesCached = 0;
+        }
+
+        Stats stats() {
+            std::lock_guard<std::mutex> guard(poolLock);
+            return counters;
+        }
+};
+
+/* Typed buffer drawn from the shared BufferPool. Resizing within the current
+capacity keeps the block, growing it swaps in a larger one without keeping the
+contents. */
+template <typename T>
+class PoolBuffer {
+
+    private:
+
+        T * items = nullptr;
+        size_t count = 0;
+        size_t capacity = 0;
+
+    public:
+
+        PoolBuffer() = default;
+
+        explicit PoolBuffer(size_t size) {
+            resize(size);
+        }
+
+        PoolBuffer(PoolBuffer && other) noexcept {
+            swap(other);
+        }
+
+        PoolBuffer & operator=(PoolBuffer && other) noexcept {
+            swap(other);
+            return *this;
+        }
+
+        PoolBuffer(const PoolBuffer &) = delete;
+        PoolBuffer & operator=(const PoolBuffer &) = delete;
+
+        ~PoolBuffer() {
+            BufferPool::shared().release(items, capacity);
+        }
+
+        void resize(size_t size) {
+            if (size * sizeof(T) > capacity) {
+                BufferPool::shared().release(items, capacity);
+                items = nullptr;
+                capacity = 0;
+                count = 0;
+                items = static_cast<T *>(BufferPool::shared().acquire(size * sizeof(T), capacity));
+            }
+            count = size;
+        }
+
+        void swap(PoolBuffer & other) noexcept {
+            std::swap(items, other.items);
+            std::swap(count, other.count);
+            std::swap(capacity, other.capacity);
+        }
+
+        T * data() { return items; }
+        const T * data() const { return items; }
+        size_t size() const { return count; }
+        T & operator[](size_t i) { return items[i]; }
+        const T & operator[](size_t i) const { return items[i]; }
+};
+
+/* Arena hands out scratch memory for one job by bumping through blocks taken from
+the BufferPool. Kernels take a Mark before allocating and rewind to it when they
+are done, and the pipeline resets the arena after each job. The blocks stay with
+the arena so the next job on the same thread starts warm. */
+class Arena {
+
+    public:
+
+        // Position in the arena to rewind to.
+        struct Mark {
+            size_t block = 0;
+            size_t used = 0;
+        };
+
+    private:
+
+        struct Block {
+            char * data;
+            size_t capacity;
+        };
+
+        static constexpr size_t MIN_BLOCK = size_t(1) << 20;
+
+        std::vector<Block> blocks = {};
+        size_t current = 0;
+        size_t used = 0;
+        size_t bytesUsed = 0;
+        size_t peakBytesUsed = 0;
+
+    public:
+
+        ~Arena() {
+            for (size_t i = 0; i < blocks.size(); i++) {
+                BufferPool::shared().release(blocks[i].data, blocks[i].capacity);
+            }
+        }
+
+        // Arena for the calling thread.
+        static Arena & forThread() {
+            static thread_local Arena arena;
+            return arena;
+        }
+
+        // Uninitialised space for count values of T, aligned to 64 bytes.
+        template <typename T>
+        T * allocate(size_t count) {
+            size_t size = ((count * sizeof(T)) + 63) & ~size_t(63);
+
+            // Move on to the next block that has room, taking a new one from the pool if needed.
+            while (current < blocks.size() && used + size > blocks[current].capacity) {
+                bytesUsed += blocks[current].capacity - used;
+                current++;
+                used = 0;
+            }
+            if (current == blocks.size()) {
+                Block block;
+                block.data = static_cast<char *>(BufferPool::shared().acquire(std::max(size, MIN_BLOCK), block.capacity));
+                blocks.push_back(block);
+            }
+
+            T * items = reinterpret_cast<T *>(blocks[current].data + used);
+            used += size;
+            bytesUsed += size;
+            peakBytesUsed = std::max(peakBytesUsed, bytesUsed);
+            return items;
+        }
+
+        Mark mark() const {
+            return {current, used};
+        }
+
+        // Free everything allocated since the mark was taken.
+        void rewind(Mark position) {
+            size_t freed = 0;
+            while (current > position.block) {
+                freed += used;
+                current--;
+                used = blocks[current].capacity;
+            }
+            freed += used - position.used;
+            used = position.used;
+            bytesUsed -= std::min(bytesUsed, freed);
+        }
+
+        void reset() {
+            rewind({0, 0});
+            bytesUsed = 0;
+        }
+
+        size_t peakBytes() const {
+            return peakBytesUsed;
+        }
+};
+
+// Rewinds an arena to where it was when the scope was entered.
+class ArenaScope {
+    private:
+        Arena & arena;
+        Arena::Mark position;
+
+    public:
+        explicit ArenaScope(Arena & scopeArena) : arena(scopeArena), position(scopeArena.mark()) {}
+
+        ~ArenaScope() {
+            arena.rewind(position);
+        }
+};
+
+/* Rows of 24 bpp pixels in one pooled buffer. Each row is padded to a multiple of
+4 bytes like a bitmap file, so the whole buffer can be written out as it is. */
+class ImageRows {
+
+    private:
+
+        PoolBuffer<char> buffer;
+        int32_t rowCount = 0;
+        size_t rowStride = 0;
+
+    public:
+
+        // Resize to width x height pixels, the pixels are not kept but the row padding is cleared.
+        void resize(int32_t width, int32_t height) {
+            size_t rowSize = size_t(width) * 3;
+            size_t stride = (rowSize + 3) & ~size_t(3);
+            buffer.resize(stride * height);
+            rowStride = stride;
+            rowCount = height;
+            if (rowStride > rowSize) {
+                for (int32_t i = 0; i < height; i++) {
+                    std::memset((*this)[i] + rowSize, 0, rowStride - rowSize);
+                }
+            }
+        }
+
+        void swap(ImageRows & other) {
+            buffer.swap(other.buffer);
+            std::swap(rowCount, other.rowCount);
+            std::swap(rowStride, other.rowStride);
+        }
+
+        // Become a copy of other, including its layout.
+        void copyFrom(ImageRows & other) {
+            rowCount = other.rowCount;
+            rowStride = other.rowStride;
+            buffer.resize(other.bytes());
+            std::memcpy(buffer.data(), other.data(), other.bytes());
+        }
+
+        // Copy a block of width x height pixels from (fromX, fromY) in other to (toX, toY).
+        void copyRect(ImageRows & other, int32_t fromX, int32_t fromY, int32_t toX, int32_t toY, int32_t width, int32_t height) {
+            for (int32_t i = 0; i < height; i++) {
+                std::memcpy((*this)[toY + i] + (size_t(toX) * 3), other[fromY + i] + (size_t(fromX) * 3), size_t(width) * 3);
+            }
+        }
+
+        char * operator[](int32_t row) {
+            return buffer.data() + (size_t(row) * rowStride);
+        }
+
+        char * data() { return buffer.data(); }
+        int32_t rows() const { return rowCount; }
+        size_t stride() const { return rowStride; }
+        size_t bytes() const { return rowStride * rowCount; }
+};
+
+// Single channel 8-bit image plane with rows stored contiguously.
+struct GrayPlane {
+    int32_t width = 0;
+    int32_t height = 0;
+    PoolBuffer<uint8_t> pixels;
+
+    uint8_t * row(int32_t y) {
+        return pixels.data() + (size_t(y) * width);
+    }
+};
+
+// Morphological operations supported by the Morphology class.
+enum class MorphOp { Erode, Dilate, Open, Close };
+
+/* Rectangular structuring element anchored at its centre. Horizontal and vertical
+lines are rectangles with a height or width of 1. */
+struct StructuringElement {
+    int32_t width = 1;
+    int32_t height = 1;
+};
+
+/* Morphology provides erosion, dilation, opening and closing with rectangular
+structuring elements. Grayscale planes use the van Herk/Gil-Werman running min/max
+so the cost per pixel does not depend on the element size. Binary planes (only 0
+and 255) are packed 64 pixels to a word and use bit-parallel shifts. Pixels outside
+the image never change the result. */
+class Morphology {
+
+    private:
+
+        struct MinOp {
+            template <typename T>
+            T operator()(T a, T b) const { return std::min(a, b); }
+        };
+
+        struct MaxOp {
+            template <typename T>
+            T operator()(T a, T b) const { return std::max(a, b); }
+        };
+
+        struct AndOp {
+            uint64_t operator()(uint64_t a, uint64_t b) const { return a & b; }
+        };
+
+        /* Running min/max of a row over windows [x - anchor, x - anchor + size - 1].
+        padded, prefix and suffix are scratch buffers of count + size - 1 values. */
+        template <typename T, typename Op>
+        static void runHorizontal(T * values, int32_t count, int32_t size, T identity, Op op,
+                                  T * padded, T * prefix, T * suffix) {
+            int32_t anchor = size / 2;
+            size_t length = size_t(count) + size - 1;
+            std::fill(padded, padded + length, identity);
+            std::copy(values, values + count, padded + anchor);
+
+            // Prefix runs from the start of each block of size values, suffix runs to its end.
+            for (size_t i = 0; i < length; i++) {
+                prefix[i] = (i % size == 0) ? padded[i] : op(prefix[i - 1], padded[i]);
+            }
+            for (size_t i = length; i-- > 0;) {
+                suffix[i] = (i == length - 1 || i % size == size_t(size - 1)) ? padded[i] : op(suffix[i + 1], padded[i]);
+            }
+
+            // Every window spans at most two blocks.
+            for (int32_t x = 0; x < count; x++) {
+                values[x] = op(suffix[x], prefix[x + size - 1]);
+            }
+        }
+
+        /* Running min/max down the columns of a plane with rowLength values per row.
+        Whole rows are combined at a time so the inner loops vectorise. */
+        template <typename T, typename Op>
+        static void runVertical(T * values, size_t rowLength, int32_t rows, int32_t size, T identity, Op op) {
+            int32_t anchor = size / 2;
+            size_t length = size_t(rows) + size - 1;
+            Arena & arena = Arena::forThread();
+            ArenaScope scope(arena);
+            T * prefix = arena.allocate<T>(length * rowLength);
+            T * suffix = arena.allocate<T>(length * rowLength);
+
+            // Padded row i is image row i - anchor, rows outside the image hold the identity.
+            T * identityRow = arena.allocate<T>(rowLength);
+            std::fill(identityRow, identityRow + rowLength, identity);
+            auto padded = [&](size_t i) -> const T * {
+                if (i < size_t(anchor) || i >= size_t(anchor) + rows) {
+                    return identityRow;
+                }
+                return values + ((i - anchor) * rowLength);
+            };
+
+            for (size_t i = 0; i < length; i++) {
+                const T * src = padded(i);
+                T * dst = &prefix[i * rowLength];
+                if (i % size == 0) {
+                    std::copy(src, src + rowLength, dst);
+                } else {
+                    const T * previous = dst - rowLength;
+                    for (size_t x = 0; x < rowLength; x++) {
+                        dst[x] = op(previous[x], src[x]);
+                    }
+                }
+            }
+            for (size_t i = length; i-- > 0;) {
+                const T * src = padded(i);
+                T * dst = &suffix[i * rowLength];
+                if (i == length - 1 || i % size == size_t(size - 1)) {
+                    std::copy(src, src + rowLength, dst);
+                } else {
+                    const T * next = dst + rowLength;
+                    for (size_t x = 0; x < rowLength; x++) {
+                        dst[x] = op(next[x], src[x]);
+                    }
+                }
+            }
+
+            for (int32_t y = 0; y < rows; y++) {
+                const T * top = &suffix[size_t(y) * rowLength];
+                const T * bottom = &prefix[(size_t(y) + size - 1) * rowLength];
+                T * dst = values + (size_t(y) * rowLength);
+                for (size_t x = 0; x < rowLength; x++) {
+                    dst[x] = op(top[x], bottom[x]);
+                }
+            }
+        }
+
+        // Grayscale erosion (min) or dilation (max) of a plane.
+        template <typename Op>
+        static void grayPass(GrayPlane & plane, StructuringElement element, uint8_t identity, Op op) {
+            if (element.width > 1) {
+                Arena & arena = Arena::forThread();
+                ArenaScope scope(arena);
+                size_t length = size_t(plane.width) + element.width - 1;
+                uint8_t * padded = arena.allocate<uint8_t>(length);
+                uint8_t * prefix = arena.allocate<uint8_t>(length);
+                uint8_t * suffix = arena.allocate<uint8_t>(length);
+                for (int32_t y = 0; y < plane.height; y++) {
+                    runHorizontal(plane.row(y), plane.width, element.width, identity, op, padded, prefix, suffix);
+                }
+            }
+            if (element.height > 1) {
+                runVertical(plane.pixels.data(), size_t(plane.width), plane.height, element.height, identity, op);
+            }
+        }
+
+        // Bit x of the result is bit x + count of row, bits past the end read as ones.
+        static void shiftDown(const uint64_t * row, uint64_t * out, size_t length, size_t count) {
+            size_t words = count / 64;
+            int bits = count % 64;
+            for (size_t i = 0; i < length; i++) {
+                uint64_t low = (i + words < length) ? row[i + words] : ~uint64_t(0);
+                uint64_t high = (i + words + 1 < length) ? row[i + words + 1] : ~uint64_t(0);
+                out[i] = bits == 0 ? low : (low >> bits) | (high << (64 - bits));
+            }
+        }
+
+        // Bit x of the result is bit x - count of row, bits before the start read as ones.
+        static void shiftUp(const uint64_t * row, uint64_t * out, size_t length, size_t count) {
+            size_t words = count / 64;
+            int bits = count % 64;
+            for (size_t i = length; i-- > 0;) {
+                uint64_t high = (i >= words) ? row[i - words] : ~uint64_t(0);
+                uint64_t low = (i >= words + 1) ? row[i - words - 1] : ~uint64_t(0);
+                out[i] = bits == 0 ? high : (high << bits) | (low >> (64 - bits));
+            }
+        }
+
+        /* AND of length consecutive bits in one direction, built by doubling the run
+        length so it costs log2(length) word operations per 64 pixels. */
+        template <typename Shift>
+        static void runBits(uint64_t * row, size_t words, int32_t length, Shift shift, uint64_t * scratch) {
+            int32_t run = 1;
+            while (run * 2 <= length) {
+                shift(row, scratch, words, run);
+                for (size_t i = 0; i < words; i++) {
+                    row[i] &= scratch[i];
+                }
+                run *= 2;
+            }
+            if (run < length) {
+                shift(row, scratch, words, length - run);
+                for (size_t i = 0; i < words; i++) {
+                    row[i] &= scratch[i];
+                }
+            }
+        }
+
+        /* Binary erosion of a packed plane, set bits are foreground. The bits past the
+        width of each row must be set so they never erode the image. */
+        static void erodeBits(uint64_t * bits, size_t wordsPerRow, int32_t rows, StructuringElement element) {
+            if (element.width > 1) {
+                int32_t anchor = element.width / 2;
+                Arena & arena = Arena::forThread();
+                ArenaScope scope(arena);
+                uint64_t * row = arena.allocate<uint64_t>(wordsPerRow);
+                uint64_t * forward = arena.allocate<uint64_t>(wordsPerRow);
+                uint64_t * scratch = arena.allocate<uint64_t>(wordsPerRow);
+                for (int32_t y = 0; y < rows; y++) {
+                    uint64_t * words = bits + (size_t(y) * wordsPerRow);
+                    // The window is anchor pixels back and width - anchor - 1 pixels forward.
+                    std::copy(words, words + wordsPerRow, row);
+                    std::copy(words, words + wordsPerRow, forward);
+                    runBits(row, wordsPerRow, anchor + 1, shiftUp, scratch);
+                    runBits(forward, wordsPerRow, element.width - anchor, shiftDown, scratch);
+                    for (size_t i = 0; i < wordsPerRow; i++) {
+                        words[i] = row[i] & forward[i];
+                    }
+                }
+            }
+            if (element.height > 1) {
+                runVertical(bits, wordsPerRow, rows, element.height, ~uint64_t(0), AndOp());
+            }
+        }
+
+        // Binary erosion or dilation of a plane holding only 0 and 255.
+        static void binaryPass(GrayPlane & plane, StructuringElement element, bool dilate) {
+            size_t wordsPerRow = (size_t(plane.width) + 63) / 64;
+            Arena & arena = Arena::forThread();
+            ArenaScope scope(arena);
+            uint64_t * bits = arena.allocate<uint64_t>(wordsPerRow * plane.height);
+            std::fill(bits, bits + (wordsPerRow * plane.height), 0);
+
+            // Dilation is the erosion of the background, so pack the inverted image for it.
+            for (int32_t y = 0; y < plane.height; y++) {
+                const uint8_t * src = plane.row(y);
+                uint64_t * words = &bits[size_t(y) * wordsPerRow];
+                for (int32_t x = 0; x < plane.width; x++) {
+                    bool set = (src[x] != 0) != dilate;
+                    words[x / 64] |= uint64_t(set) << (x % 64);
+                }
+                if (plane.width % 64 != 0) {
+                    words[wordsPerRow - 1] |= ~uint64_t(0) << (plane.width % 64);
+                }
+            }
+
+            erodeBits(bits, wordsPerRow, plane.height, element);
+
+            for (int32_t y = 0; y < plane.height; y++) {
+                uint8_t * dst = plane.row(y);
+                const uint64_t * words = &bits[size_t(y) * wordsPerRow];
+                for (int32_t x = 0; x < plane.width; x++) {
+                    bool set = ((words[x / 64] >> (x % 64)) & 1) != 0;
+                    dst[x] = (set != dilate) ? 0xff : 0x00;
+                }
+            }
+        }
+
+        static bool isBinary(const GrayPlane & plane) {
+            for (size_t i = 0; i < plane.pixels.size(); i++) {
+                if (plane.pixels[i] != 0x00 && plane.pixels[i] != 0xff) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static void erode(GrayPlane & plane, StructuringElement element, bool binary) {
+            if (binary) {
+                binaryPass(plane, element, false);
+            } else {
+                grayPass(plane, element, 0xff, MinOp());
+            }
+        }
+
+        static void dilate(GrayPlane & plane, StructuringElement element, bool binary) {
+            if (binary) {
+                binaryPass(plane, element, true);
+            } else {
+                grayPass(plane, element, 0x00, MaxOp());
+            }
+        }
+
+    public:
+
+        // Apply a morphological operation to the plane in place.
+        static void apply(GrayPlane & plane, MorphOp op, StructuringElement element) {
+            if (plane.width == 0 || plane.height == 0 || element.width < 1 || element.height < 1) {
+                return;
+            }
+
+            bool binary = isBinary(plane);
+            switch (op) {
+                case MorphOp::Erode:
+                    erode(plane, element, binary);
+                    break;
+                case MorphOp::Dilate:
+                    dilate(plane, element, binary);
+                    break;
+                case MorphOp::Open:
+                    erode(plane, element, binary);
+                    dilate(plane, element, binary);
+                    break;
+                case MorphOp::Close:
+                    dilate(plane, element, binary);
+                    erode(plane, element, binary);
+                    break;
+            }
+            return;
+        }
+
+        /* Parse an element written as "rect:WxH", "hline:L" or "vline:L". Returns false
+        if the text is not a valid element. */
+        static bool parseElement(const std::string & text, StructuringElement & element) {
+            size_t colon = text.find(':');
+            if (colon == std::string::npos) {
+                return false;
+            }
+            std::string shape = text.substr(0, colon);
+            std::string size = text.substr(colon + 1);
+            int32_t first = 0;
+            int32_t second = 0;
+            char separator = 0;
+            char trailing = 0;
+
+            if (shape == "rect") {
+                if (std::sscanf(size.c_str(), "%d%c%d%c", &first, &separator, &second, &trailing) != 3 || separator != 'x') {
+                    return false;
+                }
+                element = {first, second};
+            } else if (shape == "hline" || shape == "vline") {
+                if (std::sscanf(size.c_str(), "%d%c", &first, &trailing) != 1) {
+                    return false;
+                }
+                element = (shape == "hline") ? StructuringElement{first, 1} : StructuringElement{1, first};
+            } else {
+                return false;
+            }
+            return element.width > 0 && element.height > 0;
+        }
+};
+
+// One morphology step applied to the binary image before skeletonization.
+struct MorphStep {
+    MorphOp op = MorphOp::Open;
+    StructuringElement element = {};
+};
+
+// Ways of choosing the threshold that separates the binary image.
+enum class ThresholdMethod { Otsu, Sauvola, Bradley };
+
+/* Threshold settings. Otsu uses one value for the whole image, Sauvola and Bradley
+compare each pixel with the window around it. k is Sauvola's deviation weight or the
+fraction below the window mean that Bradley counts as dark. */
+struct ThresholdOptions {
+    ThresholdMethod method = ThresholdMethod::Otsu;
+    int32_t window = 31;
+    double k = 0;
+};
+
+/* ThreadPool runs tasks on a fixed set of worker threads that stay alive between
+tasks. The queue holds at most queueCapacity waiting tasks and submit blocks while
+it is full, which pushes back on whoever is producing the work. */
+class ThreadPool {
+
+    private:
+
+        std::vector<std::thread> workers = {};
+        std::deque< std::function<void()> > tasks = {};
+        std::mutex queueLock;
+        std::condition_variable taskReady;
+        std::condition_variable spaceReady;
+        size_t capacity = 0;
+        bool stopping = false;
 
-        // Update current stored image data.
-        void setImg(std::vector<char> img) {
-            dataOffset = *reinterpret_cast<int32_t *>(&img[10]);
-            width = *reinterpret_cast<int32_t *>(&img[18]);
-            height = *reinterpret_cast<int32_t *>(&img[22]);
+        void workerLoop() {
+            while (true) {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> guard(queueLock);
+                    taskReady.wait(guard, [this] { return stopping || !tasks.empty(); });
+                    if (tasks.empty()) {
+                        return;
+                    }
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                spaceReady.notify_one();
+                task();
+            }
+        }
+
+    public:
+
+        ThreadPool(size_t threads, size_t queueCapacity) {
+            capacity = std::max<size_t>(queueCapacity, 1);
+            threads = std::max<size_t>(threads, 1);
+            for (size_t i = 0; i < threads; i++) {
+                workers.emplace_back(&ThreadPool::workerLoop, this);
+            }
+        }
+
+        // Finish the queued tasks, then stop the workers.
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> guard(queueLock);
+                stopping = true;
+            }
+            taskReady.notify_all();
+            for (size_t i = 0; i < workers.size(); i++) {
+                workers[i].join();
+            }
+        }
 
-            currentImgHeader.resize(dataOffset);
-            std::copy(img.begin(), img.begin() + (dataOffset + 1), currentImgHeader.begin());
+        // Queue a task, waiting while the queue is full.
+        void submit(std::function<void()> task) {
+            {
+                std::unique_lock<std::mutex> guard(queueLock);
+                spaceReady.wait(guard, [this] { return tasks.size() < capacity; });
+                tasks.push_back(std::move(task));
+            }
+            taskReady.notify_one();
+        }
 
-            int index = 0 + dataOffset;
-            currentImgData.resize(height);
+        size_t size() const {
+            return workers.size();
+        }
+
+        /* Pool shared by every parallelFor in the process. The thread calling parallelFor
+        works too, so the pool has one thread fewer than the machine has cores. Its queue is
+        unbounded so that submitting from one of its own threads never blocks. */
+        static ThreadPool & compute() {
+            static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()) - 1, SIZE_MAX);
+            return pool;
+        }
+};
+
+/* Split count items into contiguous ranges and run body(begin, end) on each range,
+using the threads of the shared compute pool. The calling thread takes ranges as well
+and only waits for ranges that have started, so threads of the pool can call
+parallelFor themselves. Jobs smaller than two grains run on the calling thread. An
+exception thrown by body is passed on to the caller once every range has finished. */
+static void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> & body) {
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, count / std::max<size_t>(grain, 1));
+    if (threads <= 1) {
+        body(0, count);
+        return;
+    }
+
+    // Tasks that start after every range was taken find nothing to do, so the state they share outlives the call.
+    struct Ranges {
+        const std::function<void(size_t, size_t)> * body = nullptr;
+        size_t count = 0;
+        size_t perRange = 0;
+        size_t total = 0;
+        std::atomic<size_t> next{0};
+        size_t finished = 0;
+        std::exception_ptr failure = nullptr;
+        std::mutex lock;
+        std::condition_variable allFinished;
+    };
+    std::shared_ptr<Ranges> ranges = std::make_shared<Ranges>();
+    ranges->body = &body;
+    ranges->count = count;
+    ranges->perRange = (count + threads - 1) / threads;
+    ranges->total = (count + ranges->perRange - 1) / ranges->perRange;
+
+    auto work = [ranges] {
+        for (size_t index = ranges->next++; index < ranges->total; index = ranges->next++) {
+            size_t begin = index * ranges->perRange;
+            std::exception_ptr failure = nullptr;
+            try {
+                (*ranges->body)(begin, std::min(ranges->count, begin + ranges->perRange));
+            } catch (...) {
+                failure = std::current_exception();
+            }
+            std::lock_guard<std::mutex> guard(ranges->lock);
+            if (failure != nullptr && ranges->failure == nullptr) {
+                ranges->failure = failure;
+            }
+            if (++ranges->finished == ranges->total) {
+                ranges->allFinished.notify_all();
+            }
+        }
+    };
+    ThreadPool & pool = ThreadPool::compute();
+    for (size_t i = 1; i < ranges->total; i++) {
+        pool.submit(work);
+    }
+    work();
+
+    std::unique_lock<std::mutex> guard(ranges->lock);
+    ranges->allFinished.wait(guard, [&] { return ranges->finished == ranges->total; });
+    if (ranges->failure != nullptr) {
+        std::rethrow_exception(ranges->failure);
+    }
+}
+
+/* AdaptiveThreshold binarizes a plane against a threshold taken from the window
+around each pixel. Integral images of the values and their squares give the sum
+over any window from four lookups, so the cost per pixel does not depend on the
+window size. The integrals cover one band of rows plus the window overlap at a
+time, which keeps their memory small on very large images. Pixels at or below
+their threshold become 0, the rest 255. */
+class AdaptiveThreshold {
+
+    private:
+
+        static constexpr int32_t MAX_WINDOW = 4095;
+        static constexpr int32_t BAND_ROWS = 1024;
+        static constexpr float SAUVOLA_RANGE = 128.0f;
+
+        /* Integral image of rows [top, bottom) with a zero first row and column, entry
+        (y, x) holds the sum of value(pixel) over rows [top, top + y) and columns [0, x).
+        Rows are scanned in parallel, then strips of columns. Sums wrap around in T,
+        which is fine because every window sum fits in T and only differences are used. */
+        template <typename T, typename Value>
+        static void buildIntegral(const GrayPlane & plane, size_t top, size_t bottom, PoolBuffer<T> & integral, Value value) {
+            size_t stride = size_t(plane.width) + 1;
+            size_t rows = bottom - top;
+            integral.resize(stride * (rows + 1));
+            std::fill(integral.data(), integral.data() + stride, T(0));
+
+            parallelFor(rows, 16, [&](size_t begin, size_t end) {
+                for (size_t y = begin; y < end; y++) {
+                    const uint8_t * src = plane.pixels.data() + ((top + y) * plane.width);
+                    T * out = integral.data() + ((y + 1) * stride);
+                    T running = 0;
+                    out[0] = 0;
+                    for (int32_t x = 0; x < plane.width; x++) {
+                        running += value(src[x]);
+                        out[x + 1] = running;
+                    }
+                }
+            });
+
+            // Each strip walks down every row, adding the row above.
+            parallelFor(stride, 1024, [&](size_t begin, size_t end) {
+                for (size_t y = 2; y <= rows; y++) {
+                    const T * above = integral.data() + ((y - 1) * stride);
+                    T * row = integral.data() + (y * stride);
+                    for (size_t x = begin; x < end; x++) {
+                        row[x] += above[x];
+                    }
+                }
+            });
+        }
+
+        /* Compare one row of pixels with their window thresholds. sums, squares and
+        areas hold the window sum, sum of squares and pixel count for each pixel. */
+        template <bool Sauvola>
+        static void thresholdRow(const uint8_t * src, const float * sums, const float * squares,
+                                 const float * areas, uint8_t * dst, int32_t width, float k) {
+            int32_t x = 0;
+#ifdef __SSE2__
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 weight = _mm_set1_ps(k);
+            const __m128 inverseRange = _mm_set1_ps(1.0f / SAUVOLA_RANGE);
+            const __m128 scale = _mm_set1_ps(1.0f - k);
+            for (; x + 4 <= width; x += 4) {
+                __m128 inverseArea = _mm_div_ps(one, _mm_loadu_ps(areas + x));
+                __m128 mean = _mm_mul_ps(_mm_loadu_ps(sums + x), inverseArea);
+                __m128 limit;
+                if (Sauvola) {
+                    __m128 variance = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(squares + x), inverseArea), _mm_mul_ps(mean, mean));
+                    __m128 deviation = _mm_sqrt_ps(_mm_max_ps(variance, zero));
+                    limit = _mm_mul_ps(mean, _mm_add_ps(one, _mm_mul_ps(weight, _mm_sub_ps(_mm_mul_ps(deviation, inverseRange), one))));
+                } else {
+                    limit = _mm_mul_ps(mean, scale);
+                }
+
+                // Widen 4 pixels to floats, then narrow the comparison mask back to 4 bytes.
+                int32_t packed;
+                std::memcpy(&packed, src + x, sizeof(packed));
+                __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), _mm_setzero_si128());
+                __m128 pixels = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, _mm_setzero_si128()));
+                __m128i bright = _mm_castps_si128(_mm_cmpgt_ps(pixels, limit));
+                bright = _mm_packs_epi32(bright, bright);
+                bright = _mm_packs_epi16(bright, bright);
+                packed = _mm_cvtsi128_si32(bright);
+                std::memcpy(dst + x, &packed, sizeof(packed));
+            }
+#endif
+            for (; x < width; x++) {
+                float inverseArea = 1.0f / areas[x];
+                float mean = sums[x] * inverseArea;
+                float limit;
+                if (Sauvola) {
+                    float variance = (squares[x] * inverseArea) - (mean * mean);
+                    float deviation = std::sqrt(std::max(variance, 0.0f));
+                    limit = mean * (1.0f + (k * ((deviation * (1.0f / SAUVOLA_RANGE)) - 1.0f)));
+                } else {
+                    limit = mean * (1.0f - k);
+                }
+                dst[x] = float(src[x]) > limit ? 0xff : 0x00;
+            }
+        }
+
+    public:
+
+        // Binarize the plane in place with Sauvola or Bradley thresholding.
+        static void apply(GrayPlane & plane, const ThresholdOptions & options) {
+            if (plane.width == 0 || plane.height == 0 || options.method == ThresholdMethod::Otsu) {
+                return;
+            }
+
+            // Bradley only needs the window mean, Sauvola also needs the deviation.
+            bool sauvola = options.method == ThresholdMethod::Sauvola;
+            int32_t radius = std::min(options.window, MAX_WINDOW) / 2;
+            int32_t width = plane.width;
+            int32_t height = plane.height;
+            size_t stride = size_t(width) + 1;
+            float k = float(options.k);
+            int32_t bandRows = std::max(BAND_ROWS, radius * 8);
+
+            // Later bands read rows above them, so the result goes to its own buffer.
+            PoolBuffer<uint8_t> output(plane.pixels.size());
+            PoolBuffer<uint32_t> sumTable;
+            PoolBuffer<uint64_t> squareTable;
+
+            for (int32_t bandStart = 0; bandStart < height; bandStart += bandRows) {
+                int32_t bandEnd = std::min(bandStart + bandRows, height);
+                size_t tableTop = size_t(std::max(bandStart - radius, 0));
+                size_t tableBottom = size_t(std::min(int64_t(bandEnd) + radius, int64_t(height)));
+                buildIntegral(plane, tableTop, tableBottom, sumTable, [](uint8_t v) { return uint32_t(v); });
+                if (sauvola) {
+                    buildIntegral(plane, tableTop, tableBottom, squareTable, [](uint8_t v) { return uint64_t(v) * v; });
+                }
+
+                // Rows only read the integral images, so they are thresholded in parallel.
+                parallelFor(size_t(bandEnd - bandStart), 16, [&](size_t begin, size_t end) {
+                    Arena & arena = Arena::forThread();
+                    ArenaScope scope(arena);
+                    uint32_t * columnSums = arena.allocate<uint32_t>(stride);
+                    uint64_t * columnSquares = arena.allocate<uint64_t>(stride);
+                    float * sums = arena.allocate<float>(width);
+                    float * squares = arena.allocate<float>(width);
+                    float * areas = arena.allocate<float>(width);
+
+                    for (size_t i = begin; i < end; i++) {
+                        int32_t y = bandStart + int32_t(i);
+                        size_t top = size_t(std::max(y - radius, 0));
+                        size_t bottom = size_t(std::min(int64_t(y) + radius + 1, int64_t(height)));
+                        const uint32_t * sumTop = sumTable.data() + ((top - tableTop) * stride);
+                        const uint32_t * sumBottom = sumTable.data() + ((bottom - tableTop) * stride);
+                        for (size_t x = 0; x < stride; x++) {
+                            columnSums[x] = sumBottom[x] - sumTop[x];
+                        }
+                        if (sauvola) {
+                            const uint64_t * squareTop = squareTable.data() + ((top - tableTop) * stride);
+                            const uint64_t * squareBottom = squareTable.data() + ((bottom - tableTop) * stride);
+                            for (size_t x = 0; x < stride; x++) {
+                                columnSquares[x] = squareBottom[x] - squareTop[x];
+                            }
+                        }
+
+                        // Window sums along the row from the column sums, clipped at the edges.
+                        for (int32_t x = 0; x < width; x++) {
+                            int32_t left = std::max(x - radius, 0);
+                            int32_t right = std::min(int64_t(x) + radius + 1, int64_t(width));
+                            sums[x] = float(columnSums[right] - columnSums[left]);
+                            squares[x] = sauvola ? float(columnSquares[right] - columnSquares[left]) : 0.0f;
+                            areas[x] = float(int64_t(right - left) * int64_t(bottom - top));
+                        }
+
+                        const uint8_t * src = plane.row(y);
+                        uint8_t * dst = output.data() + (size_t(y) * width);
+                        if (sauvola) {
+                            thresholdRow<true>(src, sums, squares, areas, dst, width, k);
+                        } else {
+                            thresholdRow<false>(src, sums, squares, areas, dst, width, k);
+                        }
+                    }
+                });
+            }
+
+            plane.pixels.swap(output);
+            return;
+        }
+
+        /* Parse a method written as "otsu", "sauvola[:WINDOW[:K]]" or "bradley[:WINDOW[:T]]".
+        Returns false if the text is not a valid method. */
+        static bool parseOptions(const std::string & text, ThresholdOptions & options) {
+            size_t colon = text.find(':');
+            std::string name = text.substr(0, colon);
+            std::string settings = colon == std::string::npos ? "" : text.substr(colon + 1);
+            ThresholdOptions parsed;
+            char trailing = 0;
+
+            if (name == "otsu") {
+                options = parsed;
+                return settings.empty();
+            } else if (name == "sauvola") {
+                parsed.method = ThresholdMethod::Sauvola;
+                parsed.k = 0.34;
+            } else if (name == "bradley") {
+                parsed.method = ThresholdMethod::Bradley;
+                parsed.k = 0.15;
+            } else {
+                return false;
+            }
+
+            if (!settings.empty()) {
+                int fields = std::sscanf(settings.c_str(), "%d:%lf%c", &parsed.window, &parsed.k, &trailing);
+                if (fields < 1 || fields > 2 || (fields == 1 && settings.find(':') != std::string::npos)) {
+                    return false;
+                }
+            }
+            if (parsed.window < 3 || parsed.window > MAX_WINDOW || parsed.k < 0 || parsed.k > 1) {
+                return false;
+            }
+            options = parsed;
+            return true;
+        }
+};
+
+// Filters the resampler can use.
+enum class ResizeFilter { Box, Bilinear, Lanczos };
+
+/* Resize settings. A width or height of 0 follows the aspect ratio of the other one,
+and both 0 leaves the image at its own size. */
+struct ResizeOptions {
+    int32_t width = 0;
+    int32_t height = 0;
+    ResizeFilter filter = ResizeFilter::Bilinear;
+};
+
+/* Resampler resizes rows of 1 or 3 interleaved 8-bit channels with a separable filter.
+The weights of every output column and row are worked out once, in fixed point over a run
+of taps that stays inside the image. Each output row is filtered vertically first, over
+all the bytes of the source rows at once so the channels need no special handling, and
+then horizontally, where BGR pixels take two taps of all three channels per multiply-add.
+Output rows do not depend on each other and are split between threads. When shrinking, the filter is widened by the scale so every source pixel
+counts, which makes the box filter an area average. */
+class Resampler {
+
+    private:
+
+        static constexpr int32_t WEIGHT_BITS = 14;
+        static constexpr int32_t EXTRA_BITS = 6;
+        static constexpr int32_t LANCZOS_LOBES = 3;
+        static constexpr double PI = 3.14159265358979323846;
+        // Largest output side, given or worked out from the aspect ratio.
+        static constexpr int32_t MAX_SIDE = 1 << 20;
+
+        // Weights of each output position, taps of them from source position first[i] on.
+        struct WeightTable {
+            int32_t taps = 0;
+            std::vector<int32_t> first = {};
+            std::vector<int16_t> weights = {};
+        };
+
+        static double filterRadius(ResizeFilter filter) {
+            if (filter == ResizeFilter::Box) {
+                return 0.5;
+            }
+            return filter == ResizeFilter::Bilinear ? 1.0 : double(LANCZOS_LOBES);
+        }
+
+        static double filterWeight(ResizeFilter filter, double x) {
+            x = std::fabs(x);
+            if (filter == ResizeFilter::Box) {
+                // A source pixel exactly on the edge is shared with the neighbouring output pixel.
+                return x < 0.5 ? 1.0 : (x == 0.5 ? 0.5 : 0.0);
+            } else if (filter == ResizeFilter::Bilinear) {
+                return std::max(0.0, 1.0 - x);
+            }
+            if (x == 0) {
+                return 1.0;
+            } else if (x >= LANCZOS_LOBES) {
+                return 0.0;
+            }
+            double angle = PI * x;
+            return (LANCZOS_LOBES * std::sin(angle) * std::sin(angle / LANCZOS_LOBES)) / (angle * angle);
+        }
+
+        /* Weights mapping source positions onto target positions. Taps past the edge of the
+        image are folded onto the edge pixel, and every output position gets the same number
+        of taps so the filtering loops need no bounds checks. */
+        static WeightTable buildWeights(int32_t source, int32_t target, ResizeFilter filter) {
+            WeightTable table;
+            double scale = double(source) / target;
+            double stretch = std::max(scale, 1.0);
+            double support = filterRadius(filter) * stretch;
+            table.taps = int32_t(std::min<int64_t>(int64_t(std::ceil(support * 2)) + 2, source));
+            table.first.resize(target);
+            table.weights.assign(size_t(target) * table.taps, 0);
+
+            std::vector<double> weights(table.taps);
+            for (int32_t i = 0; i < target; i++) {
+                double center = (i + 0.5) * scale;
+                int64_t low = int64_t(std::floor(center - support - 0.5));
+                int64_t high = int64_t(std::ceil(center + support - 0.5));
+                int32_t first = int32_t(std::min<int64_t>(std::max<int64_t>(low, 0), source - table.taps));
+                table.first[i] = first;
+
+                std::fill(weights.begin(), weights.end(), 0.0);
+                double total = 0;
+                for (int64_t j = low; j <= high; j++) {
+                    double weight = filterWeight(filter, ((j + 0.5) - center) / stretch);
+                    int64_t clamped = std::min<int64_t>(std::max<int64_t>(j, 0), source - 1);
+                    weights[clamped - first] += weight;
+                    total += weight;
+                }
+
+                // Round to fixed point, giving the rounding error to the largest weight so they add up to one.
+                int16_t * fixed = &table.weights[size_t(i) * table.taps];
+                int32_t sum = 0;
+                int32_t largest = 0;
+                for (int32_t t = 0; t < table.taps; t++) {
+                    double weight = total != 0 ? weights[t] / total : 0.0;
+                    fixed[t] = int16_t(std::lround(weight * (1 << WEIGHT_BITS)));
+                    sum += fixed[t];
+                    largest = (std::abs(fixed[t]) > std::abs(fixed[largest])) ? t : largest;
+                }
+                fixed[largest] = int16_t(fixed[largest] + ((1 << WEIGHT_BITS) - sum));
+            }
+            return table;
+        }
+
+        /* Filter count bytes down the source rows into values with EXTRA_BITS more
+        precision. Lanczos can overshoot, the results still fit comfortably in 16 bits. */
+        static void verticalPass(const uint8_t * const * rows, const int16_t * weights, int32_t taps, int16_t * out, size_t count) {
+            static constexpr int32_t SHIFT = WEIGHT_BITS - EXTRA_BITS;
+            size_t x = 0;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i round = _mm_set1_epi32(1 << (SHIFT - 1));
+            for (; x + 16 <= count; x += 16) {
+                __m128i sums[4] = {round, round, round, round};
+                for (int32_t t = 0; t < taps; t += 2) {
+                    // Interleave two rows so one multiply-add applies both of their weights.
+                    bool paired = t + 1 < taps;
+                    const uint8_t * second = rows[paired ? t + 1 : t];
+                    int32_t secondWeight = paired ? weights[t + 1] : 0;
+                    __m128i weightPair = _mm_set1_epi32(int32_t(uint16_t(weights[t])) | int32_t(uint32_t(secondWeight) << 16));
+                    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[t] + x));
+                    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(second + x));
+                    __m128i aLow = _mm_unpacklo_epi8(a, zero);
+                    __m128i aHigh = _mm_unpackhi_epi8(a, zero);
+                    __m128i bLow = _mm_unpacklo_epi8(b, zero);
+                    __m128i bHigh = _mm_unpackhi_epi8(b, zero);
+                    sums[0] = _mm_add_epi32(sums[0], _mm_madd_epi16(_mm_unpacklo_epi16(aLow, bLow), weightPair));
+                    sums[1] = _mm_add_epi32(sums[1], _mm_madd_epi16(_mm_unpackhi_epi16(aLow, bLow), weightPair));
+                    sums[2] = _mm_add_epi32(sums[2], _mm_madd_epi16(_mm_unpacklo_epi16(aHigh, bHigh), weightPair));
+                    sums[3] = _mm_add_epi32(sums[3], _mm_madd_epi16(_mm_unpackhi_epi16(aHigh, bHigh), weightPair));
+                }
+                __m128i low = _mm_packs_epi32(_mm_srai_epi32(sums[0], SHIFT), _mm_srai_epi32(sums[1], SHIFT));
+                __m128i high = _mm_packs_epi32(_mm_srai_epi32(sums[2], SHIFT), _mm_srai_epi32(sums[3], SHIFT));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x), low);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x + 8), high);
+            }
+#endif
+            for (; x < count; x++) {
+                int32_t sum = 1 << (SHIFT - 1);
+                for (int32_t t = 0; t < taps; t++) {
+                    sum += int32_t(weights[t]) * rows[t][x];
+                }
+                out[x] = int16_t(std::min(std::max(sum >> SHIFT, int32_t(INT16_MIN)), int32_t(INT16_MAX)));
+            }
+        }
+
+        /* Filter one row of vertically filtered values across into width output pixels of
+        Channels interleaved channels. The row must have one value of padding after its end,
+        which the three channel multiply-add loads but gives no weight. */
+        template <int Channels>
+        static void horizontalPass(const int16_t * src, const WeightTable & table, uint8_t * dst, int32_t width) {
+            static constexpr int32_t SHIFT = WEIGHT_BITS + EXTRA_BITS;
+            for (int32_t x = 0; x < width; x++) {
+                const int16_t * weights = &table.weights[size_t(x) * table.taps];
+                const int16_t * pixels = src + (size_t(table.first[x]) * Channels);
+                int32_t sums[Channels];
+                for (int c = 0; c < Channels; c++) {
+                    sums[c] = 1 << (SHIFT - 1);
+                }
+                int32_t t = 0;
+#ifdef __SSE2__
+                if (Channels == 1 && table.taps >= 8) {
+                    // A single channel is contiguous, so eight taps go through one multiply-add.
+                    __m128i total = _mm_setzero_si128();
+                    for (; t + 8 <= table.taps; t += 8) {
+                        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + t));
+                        __m128i factors = _mm_loadu_si128(reinterpret_cast<const __m128i *>(weights + t));
+                        total = _mm_add_epi32(total, _mm_madd_epi16(values, factors));
+                    }
+                    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(1, 0, 3, 2)));
+                    total = _mm_add_epi32(total, _mm_shuffle_epi32(total, _MM_SHUFFLE(2, 3, 0, 1)));
+                    sums[0] += _mm_cvtsi128_si32(total);
+                } else if (Channels == 3 && table.taps >= 2) {
+                    /* Interleave the BGR values of two neighbouring taps, so one multiply-add with
+                    both weights gives the blue, green and red sums of the pair in its first three lanes. */
+                    __m128i total = _mm_setzero_si128();
+                    for (; t + 2 <= table.taps; t += 2) {
+                        __m128i first = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pixels + (size_t(t) * 3)));
+                        __m128i second = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(pixels + (size_t(t + 1) * 3)));
+                        uint32_t pair = uint32_t(uint16_t(weights[t])) | (uint32_t(uint16_t(weights[t + 1])) << 16);
+                        __m128i factors = _mm_set1_epi32(int32_t(pair));
+                        total = _mm_add_epi32(total, _mm_madd_epi16(_mm_unpacklo_epi16(first, second), factors));
+                    }
+                    int32_t lanes[4];
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), total);
+                    for (int c = 0; c < Channels; c++) {
+                        sums[c] += lanes[c];
+                    }
+                }
+#endif
+                for (; t < table.taps; t++) {
+                    for (int c = 0; c < Channels; c++) {
+                        sums[c] += int32_t(weights[t]) * pixels[(size_t(t) * Channels) + c];
+                    }
+                }
+                for (int c = 0; c < Channels; c++) {
+                    dst[(size_t(x) * Channels) + c] = uint8_t(std::min(std::max(sums[c] >> SHIFT, 0), 255));
+                }
+            }
+        }
+
+        // Resize rows of 1 or 3 interleaved channels from one buffer into another.
+        static void resizeRows(const uint8_t * source, size_t sourceStride, int32_t sourceWidth, int32_t sourceHeight,
+                               uint8_t * target, size_t targetStride, int32_t targetWidth, int32_t targetHeight,
+                               int32_t channels, ResizeFilter filter) {
+            WeightTable columns = buildWeights(sourceWidth, targetWidth, filter);
+            WeightTable rows = buildWeights(sourceHeight, targetHeight, filter);
+            size_t rowBytes = size_t(sourceWidth) * channels;
+
+            parallelFor(size_t(targetHeight), 16, [&](size_t begin, size_t end) {
+                Arena & arena = Arena::forThread();
+                ArenaScope scope(arena);
+                int16_t * filtered = arena.allocate<int16_t>(rowBytes + 1);
+                filtered[rowBytes] = 0;
+                const uint8_t ** taps = arena.allocate<const uint8_t *>(rows.taps);
+                for (size_t y = begin; y < end; y++) {
+                    for (int32_t t = 0; t < rows.taps; t++) {
+                        taps[t] = source + (size_t(rows.first[y] + t) * sourceStride);
+                    }
+                    verticalPass(taps, &rows.weights[y * rows.taps], rows.taps, filtered, rowBytes);
+                    if (channels == 1) {
+                        horizontalPass<1>(filtered, columns, target + (y * targetStride), targetWidth);
+                    } else {
+                        horizontalPass<3>(filtered, columns, target + (y * targetStride), targetWidth);
+                    }
+                }
+            });
+        }
+
+    public:
+
+        // Work out the size an image of width x height is resized to.
+        static void targetSize(const ResizeOptions & options, int32_t width, int32_t height, int32_t & targetWidth, int32_t & targetHeight) {
+            targetWidth = options.width;
+            targetHeight = options.height;
+            if (targetWidth == 0 && targetHeight == 0) {
+                targetWidth = width;
+                targetHeight = height;
+            } else if (targetWidth == 0) {
+                targetWidth = int32_t(std::min<double>(std::max<double>(1, std::round(double(width) * targetHeight / height)), MAX_SIDE));
+            } else if (targetHeight == 0) {
+                targetHeight = int32_t(std::min<double>(std::max<double>(1, std::round(double(height) * targetWidth / width)), MAX_SIDE));
+            }
+            return;
+        }
+
+        // Resize a single channel plane.
+        static void apply(GrayPlane & plane, const ResizeOptions & options) {
+            int32_t targetWidth;
+            int32_t targetHeight;
+            targetSize(options, plane.width, plane.height, targetWidth, targetHeight);
+            if (targetWidth == plane.width && targetHeight == plane.height) {
+                return;
+            }
+            PoolBuffer<uint8_t> output(size_t(targetWidth) * targetHeight);
+            resizeRows(plane.pixels.data(), size_t(plane.width), plane.width, plane.height,
+                       output.data(), size_t(targetWidth), targetWidth, targetHeight, 1, options.filter);
+            plane.pixels.swap(output);
+            plane.width = targetWidth;
+            plane.height = targetHeight;
+            return;
+        }
+
+        // Resize BGR rows of width x height pixels, width and height are updated to the new size.
+        static void apply(ImageRows & image, int32_t & width, int32_t & height, const ResizeOptions & options) {
+            int32_t targetWidth;
+            int32_t targetHeight;
+            targetSize(options, width, height, targetWidth, targetHeight);
+            if (targetWidth == width && targetHeight == height) {
+                return;
+            }
+            ImageRows output;
+            output.resize(targetWidth, targetHeight);
+            resizeRows(reinterpret_cast<const uint8_t *>(image.data()), image.stride(), width, height,
+                       reinterpret_cast<uint8_t *>(output.data()), output.stride(), targetWidth, targetHeight, 3, options.filter);
+            image.swap(output);
+            width = targetWidth;
+            height = targetHeight;
+            return;
+        }
+
+        /* Parse a size written as "WIDTHxHEIGHT[:box|bilinear|lanczos]", either side may
+        be 0 to keep the aspect ratio and neither may pass MAX_SIDE. Returns false if the
+        text is not a valid size. */
+        static bool parseOptions(const std::string & text, ResizeOptions & options) {
+            size_t colon = text.find(':');
+            std::string size = text.substr(0, colon);
+            std::string name = colon == std::string::npos ? "" : text.substr(colon + 1);
+            ResizeOptions parsed;
+            char trailing = 0;
+
+            if (std::sscanf(size.c_str(), "%dx%d%c", &parsed.width, &parsed.height, &trailing) != 2 ||
+                parsed.width < 0 || parsed.height < 0 || (parsed.width == 0 && parsed.height == 0) ||
+                parsed.width > MAX_SIDE || parsed.height > MAX_SIDE) {
+                return false;
+            }
+            if (name == "box") {
+                parsed.filter = ResizeFilter::Box;
+            } else if (name == "bilinear" || name.empty()) {
+                parsed.filter = ResizeFilter::Bilinear;
+            } else if (name == "lanczos") {
+                parsed.filter = ResizeFilter::Lanczos;
+            } else {
+                return false;
+            }
+            options = parsed;
+            return true;
+        }
+};
+
+// Filters the smoothing stage can apply before thresholding.
+enum class SmoothFilter { None, Box, Gaussian, Median };
+
+/* Smoothing settings. radius is the half width of the box filter and sigma the standard
+deviation of the Gaussian, the median always takes the 3x3 neighbourhood. */
+struct SmoothingOptions {
+    SmoothFilter filter = SmoothFilter::None;
+    int32_t radius = 1;
+    double sigma = 1.0;
+};
+
+/* Smoothing removes speckle from a grayscale plane before it is thresholded. The box
+filter keeps running sums along each row and down each column, so its cost per pixel
+does not depend on the radius. Each band of rows keeps the row sums of its window in a
+ring and updates the column sums a whole row at a time. The Gaussian is three box passes
+with radii chosen to match sigma. The median sorts the 3x3 neighbourhood with a fixed
+network of min and max steps, which runs on 16 pixels at once. Pixels past the edge
+repeat the edge pixel. */
+class Smoothing {
+
+    private:
+
+        static constexpr int32_t MAX_RADIUS = 127;
+        static constexpr double MAX_SIGMA = 50.0;
+
+        // Sum the window of 2 * radius + 1 pixels around each pixel of a row.
+        static void rowSums(const uint8_t * src, uint16_t * dst, int32_t width, int32_t radius) {
+            int32_t last = width - 1;
+            uint32_t sum = 0;
+            for (int32_t k = -radius; k <= radius; k++) {
+                sum += src[std::min(std::max(k, 0), last)];
+            }
+            for (int32_t x = 0; x < width; x++) {
+                dst[x] = uint16_t(sum);
+                sum += src[std::min(x + radius + 1, last)];
+                sum -= src[std::max(x - radius, 0)];
+            }
+        }
+
+        // Move the column sums down one row, adding one row of sums and removing another.
+        static void updateColumns(uint32_t * sums, const uint16_t * added, const uint16_t * removed, int32_t width) {
+            int32_t x = 0;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            for (; x + 8 <= width; x += 8) {
+                __m128i add = _mm_loadu_si128(reinterpret_cast<const __m128i *>(added + x));
+                __m128i remove = _mm_loadu_si128(reinterpret_cast<const __m128i *>(removed + x));
+                __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + x));
+                __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + x + 4));
+                low = _mm_sub_epi32(_mm_add_epi32(low, _mm_unpacklo_epi16(add, zero)), _mm_unpacklo_epi16(remove, zero));
+                high = _mm_sub_epi32(_mm_add_epi32(high, _mm_unpackhi_epi16(add, zero)), _mm_unpackhi_epi16(remove, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + x), low);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(sums + x + 4), high);
+            }
+#endif
+            for (; x < width; x++) {
+                sums[x] = (sums[x] + added[x]) - removed[x];
+            }
+        }
+
+        // Turn window sums into averages, rounding to the nearest value.
+        static void divideRow(const uint32_t * sums, uint8_t * dst, int32_t width, float inverse) {
+            int32_t x = 0;
+#ifdef __SSE2__
+            const __m128 scale = _mm_set1_ps(inverse);
+            for (; x + 8 <= width; x += 8) {
+                __m128 low = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + x))), scale);
+                __m128 high = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(sums + x + 4))), scale);
+                __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(low), _mm_cvtps_epi32(high));
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(words, words));
+            }
+#endif
+            for (; x < width; x++) {
+                dst[x] = uint8_t(std::lrint(float(sums[x]) * inverse));
+            }
+        }
+
+        /* Average every pixel over the (2 * radius + 1) square around it. Each band of rows
+        starts its column sums from the rows above it, then the ring of row sums holds the
+        rows of the current window, and the slot of the row leaving the window is reused for
+        the row entering it. */
+        static void boxBlur(GrayPlane & plane, int32_t radius) {
+            if (radius <= 0) {
+                return;
+            }
+            int32_t width = plane.width;
+            int32_t height = plane.height;
+            int32_t window = (2 * radius) + 1;
+            float inverse = 1.0f / float(window * window);
+            PoolBuffer<uint8_t> output(plane.pixels.size());
+
+            parallelFor(size_t(height), 64, [&](size_t begin, size_t end) {
+                Arena & arena = Arena::forThread();
+                ArenaScope scope(arena);
+                uint16_t * ring = arena.allocate<uint16_t>(size_t(window) * width);
+                uint16_t * entering = arena.allocate<uint16_t>(width);
+                uint32_t * sums = arena.allocate<uint32_t>(width);
+                auto slot = [&](int64_t row) {
+                    return ring + (size_t(((row % window) + window) % window) * width);
+                };
+                auto sourceRow = [&](int64_t row) {
+                    return plane.row(int32_t(std::min<int64_t>(std::max<int64_t>(row, 0), height - 1)));
+                };
+
+                std::fill(sums, sums + width, 0u);
+                for (int64_t row = int64_t(begin) - radius; row <= int64_t(begin) + radius; row++) {
+                    rowSums(sourceRow(row), slot(row), width, radius);
+                    for (int32_t x = 0; x < width; x++) {
+                        sums[x] += slot(row)[x];
+                    }
+                }
+
+                for (size_t y = begin; y < end; y++) {
+                    divideRow(sums, output.data() + (y * width), width, inverse);
+                    if (y + 1 < end) {
+                        int64_t leaving = int64_t(y) - radius;
+                        rowSums(sourceRow(int64_t(y) + radius + 1), entering, width, radius);
+                        updateColumns(sums, entering, slot(leaving), width);
+                        std::memcpy(slot(leaving), entering, size_t(width) * sizeof(uint16_t));
+                    }
+                }
+            });
+            plane.pixels.swap(output);
+        }
+
+        /* Radii of three box passes whose combined blur is closest to a Gaussian of sigma,
+        the first passes use the smaller width and the rest the next odd width up. */
+        static void gaussianRadii(double sigma, int32_t radii[3]) {
+            static constexpr int32_t PASSES = 3;
+            double ideal = std::sqrt(((12.0 * sigma * sigma) / PASSES) + 1.0);
+            int32_t narrow = int32_t(std::floor(ideal));
+            if (narrow % 2 == 0) {
+                narrow--;
+            }
+            int32_t wide = narrow + 2;
+            double narrowPasses = ((12.0 * sigma * sigma) - (PASSES * narrow * narrow) - (4.0 * PASSES * narrow) - (3.0 * PASSES)) /
+                                  ((-4.0 * narrow) - 4.0);
+            int32_t count = int32_t(std::lround(narrowPasses));
+            for (int32_t i = 0; i < PASSES; i++) {
+                radii[i] = std::min(((i < count) ? narrow : wide) / 2, MAX_RADIUS);
+            }
+        }
+
+        static uint8_t lower(uint8_t a, uint8_t b) { return std::min(a, b); }
+        static uint8_t upper(uint8_t a, uint8_t b) { return std::max(a, b); }
+#ifdef __SSE2__
+        static __m128i lower(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+        static __m128i upper(__m128i a, __m128i b) { return _mm_max_epu8(a, b); }
+#endif
+
+        template <typename T>
+        static void order(T & a, T & b) {
+            T smaller = lower(a, b);
+            b = upper(a, b);
+            a = smaller;
+        }
+
+        // Median of nine values with the 19 step network, the same steps work on single pixels and on vectors.
+        template <typename T>
+        static T median9(T p[9]) {
+            order(p[1], p[2]); order(p[4], p[5]); order(p[7], p[8]);
+            order(p[0], p[1]); order(p[3], p[4]); order(p[6], p[7]);
+            order(p[1], p[2]); order(p[4], p[5]); order(p[7], p[8]);
+            order(p[0], p[3]); order(p[5], p[8]); order(p[4], p[7]);
+            order(p[3], p[6]); order(p[1], p[4]); order(p[2], p[5]);
+            order(p[4], p[7]); order(p[4], p[2]); order(p[6], p[4]);
+            order(p[4], p[2]);
+            return p[4];
+        }
+
+        // Replace every pixel with the median of its 3x3 neighbourhood.
+        static void median(GrayPlane & plane) {
+            int32_t width = plane.width;
+            int32_t height = plane.height;
+            PoolBuffer<uint8_t> output(plane.pixels.size());
+
+            parallelFor(size_t(height), 64, [&](size_t begin, size_t end) {
+                for (size_t y = begin; y < end; y++) {
+                    const uint8_t * rows[3] = {plane.row(std::max(int32_t(y) - 1, 0)), plane.row(int32_t(y)),
+                                               plane.row(std::min(int32_t(y) + 1, height - 1))};
+                    uint8_t * dst = output.data() + (y * width);
+                    int32_t x = 0;
+
+                    // The first and last columns need their neighbours clamped, the rest load them directly.
+                    auto scalar = [&](int32_t column) {
+                        uint8_t values[9];
+                        for (int32_t i = 0; i < 3; i++) {
+                            values[(i * 3)] = rows[i][std::max(column - 1, 0)];
+                            values[(i * 3) + 1] = rows[i][column];
+                            values[(i * 3) + 2] = rows[i][std::min(column + 1, width - 1)];
+                        }
+                        dst[column] = median9(values);
+                    };
+                    if (width > 0) {
+                        scalar(x++);
+                    }
+#ifdef __SSE2__
+                    for (; x + 17 <= width; x += 16) {
+                        __m128i values[9];
+                        for (int32_t i = 0; i < 3; i++) {
+                            for (int32_t dx = 0; dx < 3; dx++) {
+                                values[(i * 3) + dx] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[i] + (x + dx - 1)));
+                            }
+                        }
+                        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), median9(values));
+                    }
+#endif
+                    for (; x < width; x++) {
+                        scalar(x);
+                    }
+                }
+            });
+            plane.pixels.swap(output);
+        }
+
+    public:
+
+        // Smooth the plane in place.
+        static void apply(GrayPlane & plane, const SmoothingOptions & options) {
+            if (plane.width == 0 || plane.height == 0) {
+                return;
+            }
+            if (options.filter == SmoothFilter::Box) {
+                boxBlur(plane, std::min(options.radius, MAX_RADIUS));
+            } else if (options.filter == SmoothFilter::Gaussian) {
+                int32_t radii[3];
+                gaussianRadii(options.sigma, radii);
+                for (int32_t i = 0; i < 3; i++) {
+                    boxBlur(plane, radii[i]);
+                }
+            } else if (options.filter == SmoothFilter::Median) {
+                median(plane);
+            }
+            return;
+        }
+
+        /* Parse a filter written as "none", "box[:RADIUS]", "gaussian[:SIGMA]" or "median".
+        Returns false if the text is not a valid filter. */
+        static bool parseOptions(const std::string & text, SmoothingOptions & options) {
+            size_t colon = text.find(':');
+            std::string name = text.substr(0, colon);
+            std::string settings = colon == std::string::npos ? "" : text.substr(colon + 1);
+            SmoothingOptions parsed;
+            char trailing = 0;
+
+            if (name == "none" || name == "median") {
+                parsed.filter = (name == "none") ? SmoothFilter::None : SmoothFilter::Median;
+                if (!settings.empty()) {
+                    return false;
+                }
+            } else if (name == "box") {
+                parsed.filter = SmoothFilter::Box;
+                if (!settings.empty() && std::sscanf(settings.c_str(), "%d%c", &parsed.radius, &trailing) != 1) {
+                    return false;
+                }
+            } else if (name == "gaussian") {
+                parsed.filter = SmoothFilter::Gaussian;
+                if (!settings.empty() && std::sscanf(settings.c_str(), "%lf%c", &parsed.sigma, &trailing) != 1) {
+                    return false;
+                }
+            } else {
+                return false;
+            }
+            if (parsed.radius < 1 || parsed.radius > MAX_RADIUS || !(parsed.sigma > 0) || parsed.sigma > MAX_SIGMA) {
+                return false;
+            }
+
+            // Below a sigma of about 0.58 every box pass has radius 0 and the blur would do nothing.
+            if (parsed.filter == SmoothFilter::Gaussian) {
+                int32_t radii[3];
+                gaussianRadii(parsed.sigma, radii);
+                if (radii[0] == 0 && radii[1] == 0 && radii[2] == 0) {
+                    return false;
+                }
+            }
+            options = parsed;
+            return true;
+        }
+};
+
+// Final mix of a 64-bit hash so every input bit affects every output bit.
+static uint64_t mixHash(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Fast 64-bit hash of a byte range. Four independent lanes each take 8 bytes per
+step so the multiplies overlap. Used for cache keys and entry checksums, not for
+security. */
+static uint64_t hashBytes(const void * data, size_t size, uint64_t seed) {
+    static constexpr uint64_t PRIME1 = 0x9e3779b185ebca87ULL;
+    static constexpr uint64_t PRIME2 = 0xc2b2ae3d27d4eb4fULL;
+    const unsigned char * bytes = static_cast<const unsigned char *>(data);
+    uint64_t lanes[4] = {seed + PRIME1, seed + PRIME2, seed, seed - PRIME1};
+    size_t i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t value;
+            std::memcpy(&value, bytes + i + (lane * 8), sizeof(value));
+            lanes[lane] += value * PRIME2;
+            lanes[lane] = (lanes[lane] << 31) | (lanes[lane] >> 33);
+            lanes[lane] *= PRIME1;
+        }
+    }
+
+    uint64_t h = size * PRIME1;
+    for (int lane = 0; lane < 4; lane++) {
+        h = (h ^ mixHash(lanes[lane])) * PRIME1;
+    }
+    for (; i < size; i++) {
+        h = (h ^ bytes[i]) * PRIME2;
+        h = (h << 27) | (h >> 37);
+    }
+    return mixHash(h);
+}
+
+// Temporary file name next to path that no other process or thread is writing.
+static std::string tempPath(const std::string & path) {
+    static std::atomic<uint64_t> counter(0);
+    return path + ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter++);
+}
+
+// Write every buffer in iov to fd, resuming after partial writes.
+static bool writeAll(int fd, std::vector<struct iovec> & iov) {
+    size_t next = 0;
+    while (next < iov.size()) {
+        int count = std::min<size_t>(iov.size() - next, IOV_MAX);
+        ssize_t written = writev(fd, &iov[next], count);
+        if (written < 0) {
+            return false;
+        }
+
+        // Skip the buffers that were fully written and advance into a partially written one.
+        while (next < iov.size() && size_t(written) >= iov[next].iov_len) {
+            written -= iov[next].iov_len;
+            next++;
+        }
+        if (written > 0) {
+            iov[next].iov_base = static_cast<char *>(iov[next].iov_base) + written;
+            iov[next].iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/* Write the buffers in iov to path through a temporary file that is renamed over it, so
+readers never see a partial file. The temporary file is removed if anything fails. */
+static bool writeAtomically(const std::string & path, std::vector<struct iovec> & iov) {
+    std::string tempName = tempPath(path);
+    int fd = open(tempName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool written = writeAll(fd, iov);
+    if (close(fd) != 0) {
+        written = false;
+    }
+    if (!written || std::rename(tempName.c_str(), path.c_str()) != 0) {
+        unlink(tempName.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* ResultCache keeps grayscale planes, histograms, thresholds and binary images on
+disk, keyed by a hash of the input pixels and the parameters that produced them.
+Each entry is a single file holding a fixed header followed by its payload, so it
+can be mapped and read in place. Entries are checked against their stored hash
+before use, and the least recently used entries are removed once the directory
+grows past its size cap. */
+class ResultCache {
+
+    private:
+
+        // Fixed header at the start of every entry file.
+        struct EntryHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t kind;
+            uint64_t key;
+            int32_t width;
+            int32_t height;
+            int32_t threshold;
+            uint32_t reserved;
+            uint64_t payloadSize;
+            uint64_t payloadHash;
+        };
+
+        static constexpr char MAGIC[8] = {'S', 'K', 'E', 'L', 'C', 'A', 'C', 'H'};
+        static constexpr uint32_t VERSION = 4;
+        static constexpr uint32_t KIND_GRAY = 1;
+        static constexpr uint32_t KIND_BINARY = 2;
+        static constexpr size_t HISTOGRAM_BYTES = 256 * sizeof(uint64_t);
+
+        std::string directory = "";
+        uint64_t maxBytes = 0;
+
+        std::string entryPath(uint64_t key, uint32_t kind) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.%s", (unsigned long long) key, kind == KIND_GRAY ? "gray" : "binary");
+            return directory + "/" + name;
+        }
+
+        /* Map an entry and hand its payload to read if the header and payload hash
+        match. Corrupt or stale entries are removed. */
+        template <typename Reader>
+        bool readEntry(uint64_t key, uint32_t kind, Reader read) {
+            std::string path = entryPath(key, kind);
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+
+            struct stat info;
+            if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(EntryHeader)) {
+                close(fd);
+                unlink(path.c_str());
+                return false;
+            }
+
+            size_t size = info.st_size;
+            void * mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                return false;
+            }
+
+            EntryHeader header;
+            std::memcpy(&header, mapping, sizeof(header));
+            const char * payload = static_cast<const char *>(mapping) + sizeof(EntryHeader);
+            bool valid = std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                         header.version == VERSION && header.kind == kind && header.key == key &&
+                         header.payloadSize == size - sizeof(EntryHeader) &&
+                         header.payloadHash == hashBytes(payload, header.payloadSize, key);
+            if (valid) {
+                valid = read(header, payload);
+            }
+            munmap(mapping, size);
+
+            if (!valid) {
+                unlink(path.c_str());
+                return false;
+            }
+
+            // Touch the entry so eviction sees it as recently used.
+            utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+            return true;
+        }
+
+        // Write an entry through a temporary file, then evict old entries.
+        bool writeEntry(uint64_t key, uint32_t kind, int32_t width, int32_t height, int32_t threshold,
+                        const PoolBuffer<char> & payload) {
+            EntryHeader header = {};
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            header.kind = kind;
+            header.key = key;
+            header.width = width;
+            header.height = height;
+            header.threshold = threshold;
+            header.payloadSize = payload.size();
+            header.payloadHash = hashBytes(payload.data(), payload.size(), key);
+
+            std::vector<struct iovec> iov = {{&header, sizeof(header)}, {const_cast<char *>(payload.data()), payload.size()}};
+            if (!writeAtomically(entryPath(key, kind), iov)) {
+                return false;
+            }
+
+            evict();
+            return true;
+        }
+
+        // Remove the least recently used entries until the cache fits its size cap.
+        void evict() {
+            DIR * dir = opendir(directory.c_str());
+            if (dir == nullptr) {
+                return;
+            }
+
+            struct CachedFile {
+                struct timespec used;
+                uint64_t size;
+                std::string path;
+            };
+            std::vector<CachedFile> files;
+            uint64_t total = 0;
+
+            while (struct dirent * item = readdir(dir)) {
+                std::string name = item->d_name;
+                bool isEntry = name.size() > 5 && (name.compare(name.size() - 5, 5, ".gray") == 0 ||
+                               (name.size() > 7 && name.compare(name.size() - 7, 7, ".binary") == 0));
+                struct stat info;
+                std::string path = directory + "/" + name;
+                if (!isEntry || stat(path.c_str(), &info) != 0) {
+                    continue;
+                }
+                files.push_back({info.st_mtim, uint64_t(info.st_size), path});
+                total += info.st_size;
+            }
+            closedir(dir);
+
+            std::sort(files.begin(), files.end(), [](const CachedFile & a, const CachedFile & b) {
+                if (a.used.tv_sec != b.used.tv_sec) {
+                    return a.used.tv_sec < b.used.tv_sec;
+                }
+                return a.used.tv_nsec < b.used.tv_nsec;
+            });
+            for (size_t i = 0; i < files.size() && total > maxBytes; i++) {
+                if (unlink(files[i].path.c_str()) == 0) {
+                    total -= files[i].size;
+                }
+            }
+            return;
+        }
+
+    public:
+
+        ResultCache(std::string cacheDirectory, uint64_t cacheBytes) {
+            directory = cacheDirectory;
+            maxBytes = cacheBytes;
+            mkdir(directory.c_str(), 0755);
+        }
+
+        /* Start of the key for an input image, built from its layout. The raw pixel
+        array is added with addToKey as it is read. */
+        static uint64_t layoutKey(const BitmapInfo & info) {
+            int64_t layout[4] = {info.width, info.height, info.bitsPerPixel, info.topDown};
+            uint64_t key = hashBytes(layout, sizeof(layout), VERSION);
+            return hashBytes(info.palette.data(), info.palette.size() * sizeof(uint32_t), key);
+        }
+
+        // Add a chunk of the raw pixel array to an input key.
+        static uint64_t addToKey(uint64_t key, const char * pixels, size_t size) {
+            return hashBytes(pixels, size, key);
+        }
+
+        // Key for an input that is resized as it is read, so its results are kept apart from the full size ones.
+        static uint64_t resizeKey(uint64_t inputKey, const ResizeOptions & resize) {
+            int32_t params[3] = {resize.width, resize.height, int32_t(resize.filter)};
+            return hashBytes(params, sizeof(params), inputKey);
+        }
+
+        // Key for the binary image of an input, including the smoothing, threshold and cleanup applied to it.
+        static uint64_t binaryKey(uint64_t inputKey, const ThresholdOptions & threshold, const SmoothingOptions & smoothing,
+                                  const std::vector<MorphStep> & cleanup) {
+            std::vector<int32_t> params;
+            if (threshold.method != ThresholdMethod::Otsu) {
+                params.push_back(-int32_t(threshold.method));
+                params.push_back(threshold.window);
+                params.push_back(int32_t(std::lround(threshold.k * 1000000)));
+            }
+            if (smoothing.filter != SmoothFilter::None) {
+                params.push_back(-16 - int32_t(smoothing.filter));
+                params.push_back(smoothing.radius);
+                params.push_back(int32_t(std::lround(smoothing.sigma * 1000000)));
+            }
+            for (size_t i = 0; i < cleanup.size(); i++) {
+                params.push_back(int32_t(cleanup[i].op));
+                params.push_back(cleanup[i].element.width);
+                params.push_back(cleanup[i].element.height);
+            }
+            return hashBytes(params.data(), params.size() * sizeof(int32_t), inputKey ^ KIND_BINARY);
+        }
+
+        // Load the grayscale plane, histogram and Otsu threshold of an input.
+        bool loadGray(uint64_t key, GrayPlane & plane, std::vector<uint64_t> & hist, int & threshold) {
+            return readEntry(key, KIND_GRAY, [&](const EntryHeader & header, const char * payload) {
+                size_t pixels = size_t(header.width) * header.height;
+                if (header.payloadSize != HISTOGRAM_BYTES + pixels) {
+                    return false;
+                }
+                hist.resize(256);
+                std::memcpy(hist.data(), payload, HISTOGRAM_BYTES);
+                plane.width = header.width;
+                plane.height = header.height;
+                plane.pixels.resize(pixels);
+                std::memcpy(plane.pixels.data(), payload + HISTOGRAM_BYTES, pixels);
+                threshold = header.threshold;
+                return true;
+            });
+        }
+
+        bool storeGray(uint64_t key, const GrayPlane & plane, const std::vector<uint64_t> & hist, int threshold) {
+            PoolBuffer<char> payload(HISTOGRAM_BYTES + plane.pixels.size());
+            std::memcpy(payload.data(), hist.data(), HISTOGRAM_BYTES);
+            std::memcpy(payload.data() + HISTOGRAM_BYTES, plane.pixels.data(), plane.pixels.size());
+            return writeEntry(key, KIND_GRAY, plane.width, plane.height, threshold, payload);
+        }
+
+        // Load a binary image, stored packed 8 pixels to a byte.
+        bool loadBinary(uint64_t key, GrayPlane & plane) {
+            return readEntry(key, KIND_BINARY, [&](const EntryHeader & header, const char * payload) {
+                size_t pixels = size_t(header.width) * header.height;
+                if (header.payloadSize != (pixels + 7) / 8) {
+                    return false;
+                }
+                plane.width = header.width;
+                plane.height = header.height;
+                plane.pixels.resize(pixels);
+                for (size_t i = 0; i < pixels; i++) {
+                    plane.pixels[i] = ((payload[i / 8] >> (i % 8)) & 1) ? 0xff : 0x00;
+                }
+                return true;
+            });
+        }
+
+        bool storeBinary(uint64_t key, const GrayPlane & plane) {
+            PoolBuffer<char> payload((plane.pixels.size() + 7) / 8);
+            std::fill(payload.data(), payload.data() + payload.size(), 0);
+            for (size_t i = 0; i < plane.pixels.size(); i++) {
+                if (plane.pixels[i] != 0) {
+                    payload[i / 8] |= char(1 << (i % 8));
+                }
+            }
+            return writeEntry(key, KIND_BINARY, plane.width, plane.height, -1, payload);
+        }
+};
+
+// Milliseconds elapsed since start.
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Why a thinning run stopped, only Converged leaves a finished skeleton.
+enum class ThinningStop { Converged, Iterations, Deadline, SlowProgress, Cancelled };
+
+// Progress of a thinning run, and once it has ended why it stopped.
+struct ThinningReport {
+    ThinningStop stop = ThinningStop::Converged;
+    int32_t iterations = 0;
+    size_t lastRemoved = 0;
+    uint64_t removed = 0;
+    double elapsedMs = 0;
+};
+
+/* Limits on a thinning run, a 0 limit is not checked. The limits are checked before
+each pass, so a run that stops keeps the result of its last full pass. progress is
+called after every pass and cancel is polled before every pass, it may be set from
+another thread or a signal handler. */
+struct ThinningLimits {
+    int32_t maxIterations = 0;
+    double deadlineMs = 0;
+    size_t minRemoved = 0;
+    std::function<void(const ThinningReport &)> progress = nullptr;
+    const std::atomic<bool> * cancel = nullptr;
+};
+
+// Name of a thinning stop reason as printed in reports.
+const char * stopName(ThinningStop stop) {
+    switch (stop) {
+        case ThinningStop::Converged:
+            return "converged";
+        case ThinningStop::Iterations:
+            return "iterations";
+        case ThinningStop::Deadline:
+            return "deadline";
+        case ThinningStop::SlowProgress:
+            return "slow_progress";
+        default:
+            return "cancelled";
+    }
+}
+
+// How the skeleton stage writes its result.
+enum class SkeletonFormat { Bitmap, Json, Graph };
+
+// Settings for the skeleton stage.
+struct SkeletonOptions {
+    SkeletonFormat format = SkeletonFormat::Bitmap;
+    ThinningLimits limits = {};
+    // Spurs up to this many pixels long are pruned, 0 keeps them all.
+    int32_t pruneLength = 0;
+};
+
+/* The eight neighbours of a skeleton pixel, shared by the tracer and the pruner so both
+agree on where endpoints and junctions are. Directions follow the Freeman chain codes, 0 is +x and the
+codes turn anticlockwise in 45 degree steps with y growing downwards. */
+struct SkeletonNeighbourhood {
+    static constexpr int32_t STEP_X[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+    static constexpr int32_t STEP_Y[8] = {0, -1, -1, -1, 0, 1, 1, 1};
+
+    /* Count the background to foreground changes going once around the ring, the number
+    of separate branches that meet at the pixel. */
+    static int32_t crossings(const bool ring[8]) {
+        int32_t changes = 0;
+        for (int direction = 0; direction < 8; direction++) {
+            changes += (!ring[direction] && ring[(direction + 1) % 8]);
+        }
+        return changes;
+    }
+
+    /* A junction joins three or more branches. Staircase corners left by thinning have
+    three neighbours without being junctions, so the neighbour count is not used. */
+    static bool isJunction(const bool ring[8]) {
+        return crossings(ring) >= 3;
+    }
+
+    // An endpoint has a single branch leaving it, one or two touching pixels wide.
+    static bool isEndpoint(const bool ring[8]) {
+        return crossings(ring) == 1 && std::count(ring, ring + 8, true) <= 2;
+    }
+};
+
+/* Skeleton traced into a graph. Nodes are endpoints, junctions, isolated pixels and one
+pixel on each closed loop. Touching junction pixels, with any pixels thinning left more
+than one pixel thick, form one node. The pixels of the node other than its own are kept
+with it, as offsets from the node pixel, so the skeleton can be redrawn exactly. Each edge runs from a start pixel through the chain codes of
+SkeletonNeighbourhood. Coordinates have their origin at the top left. */
+struct SkeletonGraph {
+    struct Node {
+        int32_t x;
+        int32_t y;
+        int32_t degree;
+    };
+
+    struct Edge {
+        uint32_t from;
+        uint32_t to;
+        int32_t x;
+        int32_t y;
+        std::vector<uint8_t> chain;
+    };
+
+    struct JunctionPixel {
+        uint32_t node;
+        int32_t dx;
+        int32_t dy;
+    };
+
+    int32_t width = 0;
+    int32_t height = 0;
+    std::vector<Node> nodes = {};
+    std::vector<Edge> edges = {};
+    std::vector<JunctionPixel> junctionPixels = {};
+};
+
+/* SkeletonTracer turns a thinned image into a SkeletonGraph and writes it as JSON or as
+a compact binary file. The image is scanned once to collect the skeleton pixels, after
+that only skeleton pixels and their neighbours are visited. */
+class SkeletonTracer {
+
+    private:
+
+        static constexpr uint32_t VERSION = 3;
+        static constexpr char MAGIC[8] = {'S', 'K', 'E', 'L', 'G', 'R', 'P', 'H'};
+        // Four-connected directions come first, so a walk steps onto staircase corners instead of cutting past them.
+        static constexpr int ORDER[8] = {0, 2, 4, 6, 1, 3, 5, 7};
+
+        template <typename T>
+        static void append(std::string & out, T value) {
+            out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        // Append a value seven bits at a time, low bits first, the top bit set on every byte but the last.
+        static void appendVarint(std::string & out, uint64_t value) {
+            while (value >= 0x80) {
+                out += char((value & 0x7f) | 0x80);
+                value >>= 7;
+            }
+            out += char(value);
+        }
+
+        // Signed values are zigzag coded first, so small negative values stay short too.
+        static void appendSigned(std::string & out, int64_t value) {
+            appendVarint(out, (uint64_t(value) << 1) ^ uint64_t(value >> 63));
+        }
+
+        // Write a whole output file through a temporary name.
+        static bool writeOutput(const std::string & path, std::string & contents) {
+            std::vector<struct iovec> iov = {{&contents[0], contents.size()}};
+            return writeAtomically(path, iov);
+        }
+
+    public:
+
+        /* Trace an image with a one pixel background border, as left by thinning. Rows are
+        stored bottom-up, so they are flipped into top-down coordinates. Pixels that join two
+        branches are path pixels, every other pixel is a node pixel. */
+        static SkeletonGraph trace(ImageRows & image, int32_t paddedWidth, int32_t paddedHeight) {
+            SkeletonGraph graph;
+            graph.width = paddedWidth - 2;
+            graph.height = paddedHeight - 2;
+
+            // Skeleton pixels in scan order, their position in this list is their slot.
+            std::vector<size_t> pixels;
+            for (int32_t row = 1; row < paddedHeight - 1; row++) {
+                const char * line = image[row];
+                for (int32_t column = 1; column < paddedWidth - 1; column++) {
+                    if (line[size_t(column) * 3] != 0) {
+                        pixels.push_back((size_t(row) * paddedWidth) + column);
+                    }
+                }
+            }
+            std::unordered_map<size_t, uint32_t> slots;
+            slots.reserve(pixels.size());
+            for (size_t i = 0; i < pixels.size(); i++) {
+                slots.emplace(pixels[i], uint32_t(i));
+            }
+
+            std::vector<int32_t> nodeOf(pixels.size(), -1);
+            auto foreground = [&](size_t index) {
+                return image[int32_t(index / paddedWidth)][(index % paddedWidth) * 3] != 0;
+            };
+            auto slotOf = [&](size_t index) {
+                return size_t(slots.find(index)->second);
+            };
+            auto neighbour = [&](size_t index, int direction) {
+                return size_t(int64_t(index) + SkeletonNeighbourhood::STEP_X[direction] -
+                              (int64_t(SkeletonNeighbourhood::STEP_Y[direction]) * paddedWidth));
+            };
+            auto pixelX = [&](size_t index) {
+                return int32_t(index % paddedWidth) - 1;
+            };
+            auto pixelY = [&](size_t index) {
+                return (paddedHeight - 2) - int32_t(index / paddedWidth);
+            };
+            auto addNode = [&](size_t index) {
+                graph.nodes.push_back({pixelX(index), pixelY(index), 0});
+                return int32_t(graph.nodes.size() - 1);
+            };
+            auto addToNode = [&](size_t slot, int32_t node) {
+                nodeOf[slot] = node;
+                graph.junctionPixels.push_back({uint32_t(node), pixelX(pixels[slot]) - graph.nodes[node].x,
+                                                pixelY(pixels[slot]) - graph.nodes[node].y});
+            };
+
+            /* Path pixels join two branches. Junctions, and thick pixels that are neither path
+            pixels nor endpoints, are gathered into clusters. */
+            std::vector<char> clustered(pixels.size(), 0);
+            std::vector<char> onPath(pixels.size(), 0);
+            for (size_t i = 0; i < pixels.size(); i++) {
+                bool ring[8];
+                for (int direction = 0; direction < 8; direction++) {
+                    ring[direction] = foreground(neighbour(pixels[i], direction));
+                }
+                onPath[i] = SkeletonNeighbourhood::crossings(ring) == 2;
+                clustered[i] = SkeletonNeighbourhood::isJunction(ring) ||
+                               (!onPath[i] && !SkeletonNeighbourhood::isEndpoint(ring) && std::count(ring, ring + 8, true) > 0);
+            }
+
+            // Every pixel that is not on a path becomes a node, touching clustered pixels share one.
+            std::vector<size_t> cluster;
+            for (size_t i = 0; i < pixels.size(); i++) {
+                if (nodeOf[i] >= 0 || onPath[i]) {
+                    continue;
+                }
+                int32_t node = addNode(pixels[i]);
+                nodeOf[i] = node;
+                cluster.assign(1, i);
+                while (clustered[i] && !cluster.empty()) {
+                    size_t slot = cluster.back();
+                    cluster.pop_back();
+                    for (int direction = 0; direction < 8; direction++) {
+                        size_t next = neighbour(pixels[slot], direction);
+                        if (!foreground(next)) {
+                            continue;
+                        }
+                        size_t nextSlot = slotOf(next);
+                        if (nodeOf[nextSlot] < 0 && clustered[nextSlot]) {
+                            addToNode(nextSlot, node);
+                            cluster.push_back(nextSlot);
+                        }
+                    }
+                }
+            }
+
+            /* Walk from a node pixel along path pixels until a node pixel is reached. Four
+            connected steps are taken before diagonal ones, so corners are not cut, and at the
+            same distance another node beats an unvisited path pixel. The node the walk
+            started from comes last. A path pixel touching two other nodes can only lead to
+            one of them, so the walk stops there and the pixel becomes a node. */
+            std::vector<char> visited(pixels.size(), 0);
+            auto follow = [&](size_t startSlot, int direction) {
+                SkeletonGraph::Edge edge;
+                edge.from = uint32_t(nodeOf[startSlot]);
+                edge.x = pixelX(pixels[startSlot]);
+                edge.y = pixelY(pixels[startSlot]);
+                edge.chain.push_back(uint8_t(direction));
+                size_t previous = pixels[startSlot];
+                size_t current = neighbour(previous, direction);
+                size_t slot = slotOf(current);
+                while (nodeOf[slot] < 0) {
+                    visited[slot] = 1;
+                    int next = -1;
+                    int32_t best = 8;
+                    int32_t touched = -1;
+                    bool branches = false;
+                    for (int i = 0; i < 8; i++) {
+                        size_t candidate = neighbour(current, ORDER[i]);
+                        if (candidate == previous || !foreground(candidate)) {
+                            continue;
+                        }
+                        size_t candidateSlot = slotOf(candidate);
+                        int32_t node = nodeOf[candidateSlot];
+                        if (node >= 0 && node != int32_t(edge.from)) {
+                            branches = branches || (touched >= 0 && touched != node);
+                            touched = node;
+                        }
+                        int32_t rank = (node < 0) ? (visited[candidateSlot] ? 8 : 1) : ((node != int32_t(edge.from)) ? 0 : 4);
+                        rank += 2 * (ORDER[i] % 2);
+                        if (rank < best) {
+                            best = rank;
+                            next = ORDER[i];
+                        }
+                    }
+                    if (next < 0 || branches) {
+                        break;
+                    }
+                    previous = current;
+                    current = neighbour(current, next);
+                    edge.chain.push_back(uint8_t(next));
+                    slot = slotOf(current);
+                }
+                if (nodeOf[slot] < 0) {
+                    nodeOf[slot] = addNode(current);
+                }
+                edge.to = uint32_t(nodeOf[slot]);
+
+                /* A pixel between two pixels of the same junction is part of that junction. A
+                walk that stopped on its first pixel joins two touching node pixels, which are
+                joined at the end with the others. */
+                if (edge.from == edge.to && edge.chain.size() <= 2) {
+                    addToNode(slotOf(neighbour(pixels[startSlot], direction)), int32_t(edge.from));
+                } else if (edge.chain.size() > 1) {
+                    graph.edges.push_back(std::move(edge));
+                }
+            };
+
+            // Follow every path leaving a node pixel that has not been walked yet.
+            auto leave = [&](size_t slot) {
+                for (int i = 0; i < 8; i++) {
+                    size_t next = neighbour(pixels[slot], ORDER[i]);
+                    if (foreground(next) && nodeOf[slotOf(next)] < 0 && !visited[slotOf(next)]) {
+                        follow(slot, ORDER[i]);
+                    }
+                }
+            };
+
+            for (size_t i = 0; i < pixels.size(); i++) {
+                if (nodeOf[i] >= 0) {
+                    leave(i);
+                }
+            }
+
+            /* Nodes added by the walks may still have paths to leave on, and closed loops have
+            no node of their own, the first pixel of each becomes one. */
+            for (size_t i = 0; i < pixels.size(); i++) {
+                if (nodeOf[i] < 0 && !visited[i]) {
+                    nodeOf[i] = addNode(pixels[i]);
+                }
+                if (nodeOf[i] >= 0) {
+                    leave(i);
+                }
+            }
+
+            // Touching pixels of two nodes are joined by a single step, once from the earlier pixel.
+            for (size_t i = 0; i < pixels.size(); i++) {
+                if (nodeOf[i] < 0) {
+                    continue;
+                }
+                for (int direction = 0; direction < 8; direction++) {
+                    size_t next = neighbour(pixels[i], direction);
+                    if (!foreground(next)) {
+                        continue;
+                    }
+                    size_t nextSlot = slotOf(next);
+                    if (nodeOf[nextSlot] >= 0 && nodeOf[nextSlot] != nodeOf[i] && i < nextSlot) {
+                        SkeletonGraph::Edge edge;
+                        edge.from = uint32_t(nodeOf[i]);
+                        edge.to = uint32_t(nodeOf[nextSlot]);
+                        edge.x = pixelX(pixels[i]);
+                        edge.y = pixelY(pixels[i]);
+                        edge.chain.push_back(uint8_t(direction));
+                        graph.edges.push_back(std::move(edge));
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < graph.edges.size(); i++) {
+                graph.nodes[graph.edges[i].from].degree++;
+                graph.nodes[graph.edges[i].to].degree++;
+            }
+
+            // Pixels added to a junction after its cluster are moved beside the rest of it.
+            std::stable_sort(graph.junctionPixels.begin(), graph.junctionPixels.end(),
+                             [](const SkeletonGraph::JunctionPixel & a, const SkeletonGraph::JunctionPixel & b) {
+                                 return a.node < b.node;
+                             });
+            return graph;
+        }
+
+        /* Write the graph as JSON. Nodes are [x, y, degree], edges are [from, to, points]
+        where points lists x, y pairs for the start, every change of direction and the end,
+        and junction pixels are [node, dx, dy] with the offset from the node pixel. */
+        static bool writeJson(const SkeletonGraph & graph, const std::string & path) {
+            std::string out;
+            char item[64];
+            std::snprintf(item, sizeof(item), "{\"width\":%d,\"height\":%d,\"nodes\":[", graph.width, graph.height);
+            out += item;
+            for (size_t i = 0; i < graph.nodes.size(); i++) {
+                const SkeletonGraph::Node & node = graph.nodes[i];
+                std::snprintf(item, sizeof(item), "%s[%d,%d,%d]", i > 0 ? "," : "", node.x, node.y, node.degree);
+                out += item;
+            }
+            out += "],\"edges\":[";
+            for (size_t i = 0; i < graph.edges.size(); i++) {
+                const SkeletonGraph::Edge & edge = graph.edges[i];
+                std::snprintf(item, sizeof(item), "%s[%u,%u,[%d,%d", i > 0 ? "," : "", edge.from, edge.to, edge.x, edge.y);
+                out += item;
+                int32_t x = edge.x;
+                int32_t y = edge.y;
+                for (size_t step = 0; step < edge.chain.size(); step++) {
+                    x += SkeletonNeighbourhood::STEP_X[edge.chain[step]];
+                    y += SkeletonNeighbourhood::STEP_Y[edge.chain[step]];
+                    if (step + 1 == edge.chain.size() || edge.chain[step + 1] != edge.chain[step]) {
+                        std::snprintf(item, sizeof(item), ",%d,%d", x, y);
+                        out += item;
+                    }
+                }
+                out += "]]";
+            }
+            out += "],\"junctionPixels\":[";
+            for (size_t i = 0; i < graph.junctionPixels.size(); i++) {
+                const SkeletonGraph::JunctionPixel & pixel = graph.junctionPixels[i];
+                std::snprintf(item, sizeof(item), "%s[%u,%d,%d]", i > 0 ? "," : "", pixel.node, pixel.dx, pixel.dy);
+                out += item;
+            }
+            out += "]}\n";
+            return writeOutput(path, out);
+        }
+
+        /* Write the graph in a compact binary form. The magic "SKELGRPH" is followed by
+        version, width, height, node count, edge count and junction pixel count as 32-bit
+        little-endian values. Everything after that is a varint, with signed values zigzag
+        coded:
+        - Each node is x and y as differences from the previous node, then its degree.
+        - Each edge is its from node as a difference from the previous edge's, its to node
+          as a difference from its from node, and its start pixel as an offset from the
+          from node's pixel. Then comes the number of steps, followed by the chain codes,
+          three bits each, low bits first and padded to a whole byte.
+        - Each junction pixel is its node as a difference from the previous pixel's node,
+          then dx and dy from the node pixel. */
+        static bool writeBinary(const SkeletonGraph & graph, const std::string & path) {
+            std::string out(MAGIC, sizeof(MAGIC));
+            append(out, VERSION);
+            append(out, graph.width);
+            append(out, graph.height);
+            append(out, uint32_t(graph.nodes.size()));
+            append(out, uint32_t(graph.edges.size()));
+            append(out, uint32_t(graph.junctionPixels.size()));
+            int32_t x = 0;
+            int32_t y = 0;
+            for (size_t i = 0; i < graph.nodes.size(); i++) {
+                appendSigned(out, int64_t(graph.nodes[i].x) - x);
+                appendSigned(out, int64_t(graph.nodes[i].y) - y);
+                appendVarint(out, uint32_t(graph.nodes[i].degree));
+                x = graph.nodes[i].x;
+                y = graph.nodes[i].y;
+            }
+            uint32_t from = 0;
+            for (size_t i = 0; i < graph.edges.size(); i++) {
+                const SkeletonGraph::Edge & edge = graph.edges[i];
+                const SkeletonGraph::Node & node = graph.nodes[edge.from];
+                appendSigned(out, int64_t(edge.from) - from);
+                appendSigned(out, int64_t(edge.to) - edge.from);
+                appendSigned(out, int64_t(edge.x) - node.x);
+                appendSigned(out, int64_t(edge.y) - node.y);
+                appendVarint(out, edge.chain.size());
+                uint32_t bits = 0;
+                int32_t count = 0;
+                for (size_t step = 0; step < edge.chain.size(); step++) {
+                    bits |= uint32_t(edge.chain[step]) << count;
+                    count += 3;
+                    if (count >= 8) {
+                        out += char(bits & 0xff);
+                        bits >>= 8;
+                        count -= 8;
+                    }
+                }
+                if (count > 0) {
+                    out += char(bits);
+                }
+                from = edge.from;
+            }
+            uint32_t node = 0;
+            for (size_t i = 0; i < graph.junctionPixels.size(); i++) {
+                const SkeletonGraph::JunctionPixel & pixel = graph.junctionPixels[i];
+                appendVarint(out, pixel.node - node);
+                appendSigned(out, pixel.dx);
+                appendSigned(out, pixel.dy);
+                node = pixel.node;
+            }
+            return writeOutput(path, out);
+        }
+
+        // Read a skeleton format name, returns false if it is not known.
+        static bool parseFormat(const std::string & text, SkeletonFormat & format) {
+            if (text == "bmp") {
+                format = SkeletonFormat::Bitmap;
+            } else if (text == "json") {
+                format = SkeletonFormat::Json;
+            } else if (text == "graph") {
+                format = SkeletonFormat::Graph;
+            } else {
+                return false;
+            }
+            return true;
+        }
+};
+
+/* SkeletonPruner removes spurs, short branches that run from an endpoint to a junction.
+One scan puts the endpoints on a queue, then each branch is walked from its endpoint until
+it meets a junction or grows longer than the limit. A branch that meets a junction in time
+is deleted. Pixels left as new endpoints are queued with the length already removed, so a
+small tree of spurs is removed whole but never more than the limit from its first tip.
+Apart from the scan only branch pixels and their neighbours are visited. Junctions are
+found with SkeletonNeighbourhood, the same test the tracer uses. */
+class SkeletonPruner {
+
+    private:
+
+        // Blue value of a pixel on the branch being walked, it still counts as foreground.
+        static constexpr char ON_PATH = 1;
+
+        struct Pixel {
+            int32_t x;
+            int32_t y;
+        };
+
+        // A queued endpoint and the length of the branch already removed behind it.
+        struct Tip {
+            Pixel pixel;
+            int32_t length;
+        };
+
+        static char * at(ImageRows & image, Pixel pixel) {
+            return image[pixel.y] + (size_t(pixel.x) * 3);
+        }
+
+        /* Steps are taken along the rows as stored, which mirrors the ring top to bottom.
+        Mirroring keeps the crossing number, and the walk keeps its order of directions. */
+        static Pixel step(Pixel pixel, int direction) {
+            return {pixel.x + SkeletonNeighbourhood::STEP_X[direction], pixel.y + SkeletonNeighbourhood::STEP_Y[direction]};
+        }
+
+        // Fill the ring of neighbours around a pixel and return how many are foreground.
+        static int32_t ringAround(ImageRows & image, Pixel pixel, bool ring[8]) {
+            int32_t count = 0;
+            for (int direction = 0; direction < 8; direction++) {
+                ring[direction] = *at(image, step(pixel, direction)) != 0;
+                count += ring[direction];
+            }
+            return count;
+        }
+
+        // Count the foreground neighbours and the background to foreground changes around a pixel.
+        static int32_t crossings(ImageRows & image, Pixel pixel, int32_t & count) {
+            bool ring[8];
+            count = ringAround(image, pixel, ring);
+            return SkeletonNeighbourhood::crossings(ring);
+        }
+
+        static bool isEndpoint(ImageRows & image, Pixel pixel) {
+            bool ring[8];
+            ringAround(image, pixel, ring);
+            return *at(image, pixel) != 0 && SkeletonNeighbourhood::isEndpoint(ring);
+        }
+
+        // A branch ends once it touches a junction, not only when it steps onto one.
+        static bool touchesJunction(ImageRows & image, Pixel pixel) {
+            bool ring[8];
+            for (int direction = 0; direction < 8; direction++) {
+                Pixel neighbour = step(pixel, direction);
+                char value = *at(image, neighbour);
+                if (value == 0 || value == ON_PATH) {
+                    continue;
+                }
+                ringAround(image, neighbour, ring);
+                if (SkeletonNeighbourhood::isJunction(ring)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /* Pick the next pixel of a branch among the unmarked neighbours of the current one.
+        Where a corner leaves two of them touching, the one that leads on beats the one that
+        only touches the branch, and a four-connected step wins a tie. */
+        static bool nextPixel(ImageRows & image, Pixel current, Pixel & next) {
+            int32_t bestScore = -1;
+            for (int direction = 0; direction < 8; direction++) {
+                Pixel candidate = step(current, direction);
+                char value = *at(image, candidate);
+                if (value == 0 || value == ON_PATH) {
+                    continue;
+                }
+                int32_t score = 0;
+                for (int around = 0; around < 8; around++) {
+                    Pixel beyond = step(candidate, around);
+                    char beyondValue = *at(image, beyond);
+                    bool besideCurrent = std::abs(beyond.x - current.x) <= 1 && std::abs(beyond.y - current.y) <= 1;
+                    score += (beyondValue != 0 && beyondValue != ON_PATH && !besideCurrent);
+                }
+                score = (score * 2) + (direction % 2 == 0);
+                if (score > bestScore) {
+                    bestScore = score;
+                    next = candidate;
+                }
+            }
+            return bestScore >= 0;
+        }
+
+    public:
+
+        /* Prune spurs up to maxLength pixels long from an image with a one pixel background
+        border, as left by thinning. Returns the number of pixels removed. */
+        static size_t prune(ImageRows & image, int32_t paddedWidth, int32_t paddedHeight, int32_t maxLength) {
+            if (maxLength <= 0) {
+                return 0;
+            }
+
+            std::deque<Tip> queue;
+            for (int32_t row = 1; row < paddedHeight - 1; row++) {
+                const char * line = image[row];
+                for (int32_t column = 1; column < paddedWidth - 1; column++) {
+                    if (line[size_t(column) * 3] != 0 && isEndpoint(image, {column, row})) {
+                        queue.push_back({{column, row}, 0});
+                    }
+                }
+            }
+
+            size_t removed = 0;
+            int32_t count;
+            std::vector<Pixel> path;
+            while (!queue.empty()) {
+                Tip tip = queue.front();
+                queue.pop_front();
+                // Earlier deletions may have removed this tip or joined it up again.
+                if (!isEndpoint(image, tip.pixel)) {
+                    continue;
+                }
+
+                path.assign(1, tip.pixel);
+                *at(image, tip.pixel) = ON_PATH;
+                int32_t length = tip.length + 1;
+                bool spur = touchesJunction(image, tip.pixel);
+                Pixel next;
+                while (!spur && length < maxLength && nextPixel(image, path.back(), next)) {
+                    path.push_back(next);
+                    *at(image, next) = ON_PATH;
+                    length++;
+                    spur = touchesJunction(image, next);
+                }
+
+                /* Delete from the tip inwards while each pixel is still the end of the branch,
+                which stops at a pixel that joins two pieces where the walk missed a junction.
+                A branch that is too long, or a separate piece with no junction, stays. */
+                size_t deleted = 0;
+                while (spur && deleted < path.size() && crossings(image, path[deleted], count) == 1) {
+                    std::memset(at(image, path[deleted]), 0x00, 3);
+                    deleted++;
+                }
+                for (size_t i = deleted; i < path.size(); i++) {
+                    *at(image, path[i]) = char(0xFF);
+                }
+                removed += deleted;
+
+                // Corner pixels beside the branch are left alone or as new tips, tidy them up.
+                for (size_t i = 0; i < deleted; i++) {
+                    for (int direction = 0; direction < 8; direction++) {
+                        Pixel neighbour = step(path[i], direction);
+                        if (*at(image, neighbour) == 0) {
+                            continue;
+                        }
+                        crossings(image, neighbour, count);
+                        if (count == 0) {
+                            std::memset(at(image, neighbour), 0x00, 3);
+                            removed++;
+                        } else if (isEndpoint(image, neighbour)) {
+                            queue.push_back({neighbour, length});
+                        }
+                    }
+                }
+            }
+            return removed;
+        }
+};
+
+// Read-only stream buffer over a block of memory, used for images in shared memory.
+class MemoryBuffer : public std::streambuf {
+    public:
+        MemoryBuffer(const char * data, size_t size) {
+            char * begin = const_cast<char *>(data);
+            setg(begin, begin, begin + size);
+        }
+
+    protected:
+
+        // Seeking lets readers find out how many bytes are left before they allocate for them.
+        pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode) override {
+            off_type base = (dir == std::ios_base::beg) ? 0 : (dir == std::ios_base::cur) ? gptr() - eback() : egptr() - eback();
+            off_type position = base + offset;
+            if (position < 0 || position > egptr() - eback()) {
+                return pos_type(off_type(-1));
+            }
+            setg(eback(), eback() + position, egptr());
+            return pos_type(position);
+        }
+
+        pos_type seekpos(pos_type position, std::ios_base::openmode which) override {
+            return seekoff(off_type(position), std::ios_base::beg, which);
+        }
+};
+
+// Pixel bounds of a tile, columns [x0, x1) and rows [y0, y1).
+struct PixelRect {
+    int32_t x0 = 0;
+    int32_t y0 = 0;
+    int32_t x1 = 0;
+    int32_t y1 = 0;
+};
+
+/* State carried from one frame of a sequence to the next. Frames are split into
+square tiles, a tile whose raw pixels hash the same as in the previous frame reuses
+that frame's grayscale and binary pixels, and only tiles whose binary pixels changed
+are thinned again, together with a halo around them. */
+struct FrameHistory {
+    static constexpr int32_t TILE_SIZE = 64;
+    // Pixels a thinning pass can reach, one for each of its eight masks.
+    static constexpr int32_t MASK_REACH = 8;
+
+    // Pixels around a changed tile that are thinned again, and thinned for context.
+    int32_t halo = 32;
+    // Largest histogram distance (0 to 1) at which the previous threshold is kept.
+    double histogramTolerance = 0.01;
+
+    // Layout of the previous frame, tiles are only compared between frames of the same size.
+    int32_t width = 0;
+    int32_t height = 0;
+    int32_t tilesX = 0;
+    int32_t tilesY = 0;
+    std::vector<uint64_t> tileHashes = {};
+
+    // Tiles of the current frame whose grayscale or binary pixels changed.
+    std::vector<char> grayDirty = {};
+    std::vector<char> binaryDirty = {};
+
+    // Results of the previous frame, each valid once its stage has run at this layout.
+    ImageRows gray;
+    std::vector<uint64_t> grayHist = {};
+    bool grayValid = false;
+    ImageRows binary;
+    int binaryThreshold = -1;
+    bool binaryValid = false;
+    ImageRows skeleton;
+    bool skeletonValid = false;
+    // Thinning passes the previous frame needed, which sizes the first window tried.
+    int32_t passes = 0;
+
+    // Histogram the current threshold was computed from.
+    std::vector<uint64_t> thresholdHist = {};
+    int threshold = -1;
+
+    // What was reused for the frame just processed.
+    size_t grayTilesChanged = 0;
+    size_t binaryTilesChanged = 0;
+    size_t tilesThinned = 0;
+    bool thresholdReused = false;
+
+    // Start again from a frame of a new size, nothing from the old size can be reused.
+    void setLayout(int32_t frameWidth, int32_t frameHeight) {
+        width = frameWidth;
+        height = frameHeight;
+        tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        tileHashes.assign(size_t(tilesX) * tilesY, 0);
+        grayDirty.assign(tileHashes.size(), 1);
+        binaryDirty.assign(tileHashes.size(), 1);
+        grayValid = false;
+        binaryValid = false;
+        skeletonValid = false;
+    }
+
+    size_t tileCount() const {
+        return size_t(tilesX) * tilesY;
+    }
+
+    PixelRect tile(size_t index) const {
+        PixelRect rect;
+        rect.x0 = int32_t(index % tilesX) * TILE_SIZE;
+        rect.y0 = int32_t(index / tilesX) * TILE_SIZE;
+        rect.x1 = std::min(rect.x0 + TILE_SIZE, width);
+        rect.y1 = std::min(rect.y0 + TILE_SIZE, height);
+        return rect;
+    }
+};
+
+class Image {
+    private:
+        // Initialize class variables 
+        std::vector<char> currentImgHeader = {}; 
+        ImageRows currentImgData;
+        ImageRows maskScratch;
+        PoolBuffer<char> fileScratch;
+        std::vector<uint64_t> currentHist = {};
+        int32_t dataOffset = 0;
+        int32_t height = 0;
+        int32_t width = 0;
+
+        bool skeletonComplete = false;
+        bool grayscaleLoaded = false;
+        bool grayscaleCached = false;
+        int currentThreshold = -1;
+
+        // Optional cache of earlier results, keyed from the input pixels.
+        ResultCache * cache = nullptr;
+        uint64_t inputKey = 0;
+
+        // Directory the output images are written to, empty for the working directory.
+        std::string outputDirectory = "";
+        std::string outputPrefix = "";
+
+        // Results of the previous frame when processing a sequence.
+        FrameHistory * history = nullptr;
+
+        // Size the image is resized to as soon as it is read.
+        ResizeOptions resizeOptions = {};
+
+        // Copy one 24 bpp row, which already has the stored BGR layout.
+        template <int BitsPerPixel>
+        static typename std::enable_if<BitsPerPixel == 24>::type
+        decodeRow(const char * src, char * dst, int32_t width, const BitmapInfo &) {
+            std::memcpy(dst, src, size_t(width) * 3);
+        }
+
+        // Drop the alpha channel of one 32 bpp BGRA row.
+        template <int BitsPerPixel>
+        static typename std::enable_if<BitsPerPixel == 32>::type
+        decodeRow(const char * src, char * dst, int32_t width, const BitmapInfo &) {
+            int32_t x = 0;
+#ifdef __SSE2__
+            // Rows are 4-byte aligned, step pixels one at a time until the loads are 16-byte aligned.
+            for (; x < width && (reinterpret_cast<uintptr_t>(src + (size_t(x) * 4)) & 15) != 0; x++) {
+                dst[(size_t(x) * 3)] = src[(size_t(x) * 4)];
+                dst[(size_t(x) * 3) + 1] = src[(size_t(x) * 4) + 1];
+                dst[(size_t(x) * 3) + 2] = src[(size_t(x) * 4) + 2];
+            }
+
+            /* Pack 4 BGRA pixels into 12 BGR bytes, the 16 byte store overlaps the next group.
+            The gap left by the alpha byte is closed inside each 64-bit half first, then the
+            gap between the two halves. */
+            const __m128i lowPixel = _mm_set1_epi64x(0x0000000000FFFFFFLL);
+            const __m128i highPixel = _mm_set1_epi64x(0x0000FFFFFF000000LL);
+            const __m128i firstHalf = _mm_setr_epi32(-1, 0xFFFF, 0, 0);
+            for (; x + 5 < width; x += 4) {
+                __m128i pixels = _mm_load_si128(reinterpret_cast<const __m128i *>(src + (size_t(x) * 4)));
+                __m128i halves = _mm_or_si128(_mm_and_si128(pixels, lowPixel), _mm_and_si128(_mm_srli_epi64(pixels, 8), highPixel));
+                __m128i packed = _mm_or_si128(_mm_and_si128(halves, firstHalf), _mm_andnot_si128(firstHalf, _mm_srli_si128(halves, 2)));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + (size_t(x) * 3)), packed);
+            }
+#endif
+            for (; x < width; x++) {
+                dst[(size_t(x) * 3)] = src[(size_t(x) * 4)];
+                dst[(size_t(x) * 3) + 1] = src[(size_t(x) * 4) + 1];
+                dst[(size_t(x) * 3) + 2] = src[(size_t(x) * 4) + 2];
+            }
+        }
+
+        // Expand one 8 bpp row through the palette.
+        template <int BitsPerPixel>
+        static typename std::enable_if<BitsPerPixel == 8>::type
+        decodeRow(const char * src, char * dst, int32_t width, const BitmapInfo & info) {
+            const std::vector<uint32_t> & palette = info.palette;
+            for (int32_t x = 0; x < width; x++) {
+                uint8_t entry = uint8_t(src[x]);
+                uint32_t color = entry < palette.size() ? palette[entry] : 0;
+                dst[(size_t(x) * 3)] = char(color & 0xff);
+                dst[(size_t(x) * 3) + 1] = char((color >> 8) & 0xff);
+                dst[(size_t(x) * 3) + 2] = char((color >> 16) & 0xff);
+            }
+        }
+
+        // Decode a chunk of file rows starting at firstRow, rows are always stored bottom-up.
+        template <int BitsPerPixel, bool TopDown>
+        void decodeRows(const char * pixels, int32_t firstRow, int32_t rows, const BitmapInfo & info) {
+            for (int32_t i = 0; i < rows; i++) {
+                // Top-down files store the last image row first.
+                int32_t fileRow = firstRow + i;
+                int32_t row = TopDown ? (height - 1 - fileRow) : fileRow;
+                decodeRow<BitsPerPixel>(pixels + (size_t(i) * info.rowStride), currentImgData[row], width, info);
+            }
+        }
+
+        // Pick the decoder specialised for the pixel format and row orientation.
+        template <int BitsPerPixel>
+        void decodeOriented(const char * pixels, int32_t firstRow, int32_t rows, const BitmapInfo & info) {
+            if (info.topDown) {
+                decodeRows<BitsPerPixel, true>(pixels, firstRow, rows, info);
+            } else {
+                decodeRows<BitsPerPixel, false>(pixels, firstRow, rows, info);
+            }
+        }
+
+        // Decode a chunk of rows read from the file.
+        void decodeChunk(const char * pixels, int32_t firstRow, int32_t rows, const BitmapInfo & info) {
+            switch (info.bitsPerPixel) {
+                case 8:
+                    decodeOriented<8>(pixels, firstRow, rows, info);
+                    break;
+                case 24:
+                    decodeOriented<24>(pixels, firstRow, rows, info);
+                    break;
+                case 32:
+                    decodeOriented<32>(pixels, firstRow, rows, info);
+                    break;
+            }
+            return;
+        }
+
+        // Store the headers and dimensions of a newly opened image.
+        void setHeader(const std::vector<char> & header, const BitmapInfo & info) {
+            width = info.width;
+            height = info.height;
+
+            // Keep the file and info headers, the image is always written back as bottom-up 24 bpp.
+            dataOffset = 14 + info.infoSize;
+            currentImgHeader.assign(header.begin(), header.begin() + dataOffset);
+            uint16_t bitsPerPixel = 24;
+            uint32_t compression = BI_RGB;
+            uint32_t coloursUsed = 0;
+            std::memcpy(&currentImgHeader[10], &dataOffset, sizeof(dataOffset));
+            std::memcpy(&currentImgHeader[28], &bitsPerPixel, sizeof(bitsPerPixel));
+            std::memcpy(&currentImgHeader[30], &compression, sizeof(compression));
+            std::memcpy(&currentImgHeader[46], &coloursUsed, sizeof(coloursUsed));
+            std::memcpy(&currentImgHeader[50], &coloursUsed, sizeof(coloursUsed));
+            return;
+        }
+
+        // Finish updating the current stored image once every row has been decoded.
+        void setImg(const BitmapInfo & info) {
+            // A palette of equal BGR entries means the pixels are already grayscale.
+            grayscaleLoaded = (info.bitsPerPixel == 8);
+            for (size_t i = 0; i < info.palette.size(); i++) {
+                uint32_t color = info.palette[i];
+                if ((color & 0xff) != ((color >> 8) & 0xff) || (color & 0xff) != ((color >> 16) & 0xff)) {
+                    grayscaleLoaded = false;
+                }
+            }
+
+            // Other images get their histogram once they are converted to grayscale.
+            if (grayscaleLoaded) {
+                setHistogram();
+            }
+            return;
+        }
+
+        // Creates the histogram of an image
+        void setHistogram() {
+            currentHist.assign(256, 0);
+
+            for (int i = 0; i < height; i++) {
+                const char * row = currentImgData[i];
+                for (size_t j = 0; j < (size_t(width) * 3); j += 3){
+                    currentHist[int(row[j] & 0xff)]++;
+                }
+            }
+
+            return;
+        }
+
+        // Retrieves a threshold value using Otsu's method.
+        int otsuThreshold() {
+            
+            // Set histogram and total number of pixels.
+            const std::vector<uint64_t> & hist = currentHist;
+            uint64_t total = uint64_t(height) * width;
+
+            // Retrieve sum value to compute average foreground value
+            double sum = 0;
+            for(int i=0; i < 256; i++) {
+                sum += i * hist[i];
+            }
+
+            // Initialize remaining variables
+            double sumBackground = 0;
+            long double weightBackground = 0;
+            long double weightForeground = 0;
+
+            double varMax = 0;
+            int threshold = 0;
+
+            for(int i=0; i < 256; i++) {
+                // Histogram value at current threshold added to background weight.
+                weightBackground += hist[i];
+                // If background weight = 0 continue to next iteration.
+                if(weightBackground == 0) {
+                    continue;
+                }
+
+                // Foreground weight equals all the other pixels not located in the background.
+                weightForeground = total - weightBackground;
+                // If foreground weight = 0 then break out of the loop.
+                if (weightForeground == 0) {
+                    break;
+                }
+                
+                // calculate sum to find average background value.
+                sumBackground += i * hist[i];
+
+                // Calculate average values.
+                double averagerBackground = sumBackground / weightBackground;
+                double averageForeground = (sum - sumBackground) / weightForeground;
+
+                // Calculate between variance.
+                double varBetween = weightBackground * weightForeground * 
+                                    (averagerBackground - averageForeground) *
+                                    (averagerBackground - averageForeground);
+
+                /* If between variance is greater than max variance then set new
+                threshold value and set max variance to the between variance. */ 
+                if (varBetween > varMax) {
+                    varMax = varBetween;
+                    threshold = i;
+                }
+            }
+
+            // Return threshold value.
+            return threshold;
+        }
+
+        void addImagePadding() {
+            // Copy the image into a pooled buffer with a one pixel background border.
+            ImageRows padded;
+            padded.resize(width + 2, height + 2);
+            size_t paddedSize = size_t(width + 2) * 3;
+            std::memset(padded[0], 0x00, paddedSize);
+            std::memset(padded[height + 1], 0x00, paddedSize);
+            for (int i = 0; i < height; i++) {
+                char * row = padded[i + 1];
+                std::memset(row, 0x00, 3);
+                std::memcpy(row + 3, currentImgData[i], size_t(width) * 3);
+                std::memset(row + 3 + (size_t(width) * 3), 0x00, 3);
+            }
+
+            // Set new height and width, the header is updated when the image is written.
+            width = width + 2;
+            height = height + 2;
+            currentImgData.swap(padded);
+            return;
+        }
+
+        /* Apply a hit-or-miss mask to every foreground pixel of a padded image, returns the
+        number of pixels removed. */
+        size_t applyMask(ImageRows & image, int32_t imageWidth, int32_t imageHeight, const std::vector< std::vector<int> > & mask) {
+
+            bool fit = true;
+            size_t removed = 0;
+
+            // Masks are matched against the image as it was before this pass.
+            ImageRows & original = maskScratch;
+            original.resize(imageWidth, imageHeight);
+            std::memcpy(original.data(), image.data(), image.bytes());
+            
+            // Iterate through each pixel, skipping the padding around the border.
+            for (int i = 1; i < imageHeight - 1; i++) {
+                char * row = image[i];
+                for (size_t j = 3; j < size_t(imageWidth - 1) * 3; j += 3) {
+                    
+                    // Iterate through each mask element.
+                    if (int(row[j] & 0xff) == 255) {
+                        fit = true;
+                        for (size_t x = 0; x < mask.size(); x++) {
+                            const char * maskRow = original[i + (int(x) - 1)];
+                            for (size_t y = 0; y < mask[x].size(); y ++) {
+                                // Find the index for the corresponding pixel value.
+                                size_t index2 = (j + (y * 3)) - 3;
+                                if (mask[x][y] != 1) {
+                                    // Compare mask value with corresponding pixel value.
+                                    if (int(maskRow[index2] & 0xff) != mask[x][y]){
+                                        // If mask doesn't fit, break from loop.
+                                        fit = false;
+                                        break;
+                                    }
+                                }
+
+                            }
+                            if (!fit) {
+                                break;
+                            }
+                        }
+                        // If mask fits set pixel to background.
+                        if (fit) {
+                            row[j] = 0x00;
+                            row[j+1] = 0x00;
+                            row[j+2] = 0x00;
+                            removed++;
+                        }
+                    }
+                }
+            }
+            return removed;
+        }
+
+        // Remove one layer of boundary pixels from a padded image, returns the number of pixels removed.
+        size_t thinningItr(ImageRows & image, int32_t imageWidth, int32_t imageHeight) {
+            // Create masks to apply to each individual pixel.
+            static const std::vector< std::vector<int> > structEl1 = {{0,0,0}, 
+                                                                      {1,255,1},
+                                                                      {255,255,255}};
+
+            static const std::vector< std::vector<int> > structEl2 = {{1,0,0},
+                                                                      {255,255,0},
+                                                                      {1,255,1}};
+
+            static const std::vector< std::vector<int> > structEl3 = {{255,1,0}, 
+                                                                      {255,255,0},
+                                                                      {255,1,0}};
+                                                         
+            static const std::vector< std::vector<int> > structEl4 = {{1,255,1},
+                                                                      {255,255,0},
+                                                                      {1,0,0}};
+
+            static const std::vector< std::vector<int> > structEl5 = {{255,255,255}, 
+                                                                      {1,255,1},
+                                                                      {0,0,0}};
+                                                         
+            static const std::vector< std::vector<int> > structEl6 = {{1,255,1},
+                                                                      {0,255,255},
+                                                                      {0,0,1}};
+
+            static const std::vector< std::vector<int> > structEl7 = {{0,1,255}, 
+                                                                      {0,255,255},
+                                                                      {0,1,255}};
+                                                         
+            static const std::vector< std::vector<int> > structEl8 = {{0,0,1},
+                                                                      {0,255,255},
+                                                                      {1,255,1}};
+
+            // Apply all the mask to each pixel.
+            size_t removed = 0;
+            removed += applyMask(image, imageWidth, imageHeight, structEl1);
+            removed += applyMask(image, imageWidth, imageHeight, structEl2);
+            removed += applyMask(image, imageWidth, imageHeight, structEl3);
+            removed += applyMask(image, imageWidth, imageHeight, structEl4);
+            removed += applyMask(image, imageWidth, imageHeight, structEl5);
+            removed += applyMask(image, imageWidth, imageHeight, structEl6);
+            removed += applyMask(image, imageWidth, imageHeight, structEl7);
+            removed += applyMask(image, imageWidth, imageHeight, structEl8);
+
+            // If no pixels were removed the image is unchanged and the skeleton is complete.
+            if (removed == 0) {
+                skeletonComplete = true;
+            }
+            return removed;
+        }
+
+        /* Thin a padded image until it stops changing or one of the limits is reached, and
+        return the number of passes run. start is when the whole run began and report
+        carries on from earlier windows of the same run, so the deadline covers all of them
+        and a stop reason is kept. */
+        int32_t thinImage(ImageRows & image, int32_t imageWidth, int32_t imageHeight, const ThinningLimits & limits,
+                       std::chrono::steady_clock::time_point start, ThinningReport & report) {
+            skeletonComplete = false;
+            int32_t passes = 0;
+            while (true) {
+                if (limits.cancel != nullptr && limits.cancel->load()) {
+                    report.stop = ThinningStop::Cancelled;
+                    break;
+                } else if (limits.maxIterations > 0 && passes >= limits.maxIterations) {
+                    report.stop = ThinningStop::Iterations;
+                    break;
+                } else if (limits.deadlineMs > 0 && elapsedMs(start) >= limits.deadlineMs) {
+                    report.stop = ThinningStop::Deadline;
+                    break;
+                }
+
+                size_t removed = thinningItr(image, imageWidth, imageHeight);
+                passes++;
+                report.iterations = std::max(report.iterations, passes);
+                report.lastRemoved = removed;
+                report.removed += removed;
+                report.elapsedMs = elapsedMs(start);
+                if (limits.progress) {
+                    limits.progress(report);
+                }
+
+                if (skeletonComplete) {
+                    break;
+                } else if (removed < limits.minRemoved) {
+                    report.stop = ThinningStop::SlowProgress;
+                    break;
+                }
+            }
+            report.elapsedMs = elapsedMs(start);
+            return passes;
+        }
+
+        // Read the layout of the pixel array from the bitmap headers.
+        bool parseHeader(const std::vector<char> & header, BitmapInfo & info) {
+            if (header[0] != 'B' || header[1] != 'M') {
+                return false;
+            }
+
+            std::memcpy(&info.dataOffset, &header[10], sizeof(info.dataOffset));
+            std::memcpy(&info.infoSize, &header[14], sizeof(info.infoSize));
+            std::memcpy(&info.width, &header[18], sizeof(info.width));
+            std::memcpy(&info.height, &header[22], sizeof(info.height));
+            std::memcpy(&info.bitsPerPixel, &header[28], sizeof(info.bitsPerPixel));
+            std::memcpy(&info.compression, &header[30], sizeof(info.compression));
+
+            // Negative heights mark top-down images.
+            info.topDown = info.height < 0;
+            if (info.topDown) {
+                info.height = -info.height;
+            }
+            if (info.width <= 0 || info.height <= 0) {
+                return false;
+            }
+
+            // Rows are padded to a multiple of 4 bytes.
+            info.rowStride = ((size_t(info.width) * info.bitsPerPixel + 31) / 32) * 4;
+
+            if (info.bitsPerPixel == 24 || info.bitsPerPixel == 8) {
+                return info.compression == BI_RGB;
+            }
+            if (info.bitsPerPixel != 32) {
+                return false;
+            }
+            if (info.compression == BI_RGB) {
+                return true;
+            }
+            if (info.compression != BI_BITFIELDS && info.compression != BI_ALPHABITFIELDS) {
+                return false;
+            }
+
+            // V4 and V5 headers hold the masks, a plain info header is followed by them.
+            if (header.size() < 14 + 40 + 12) {
+                return false;
+            }
+            uint32_t masks[3];
+            std::memcpy(masks, &header[14 + 40], sizeof(masks));
+            return masks[0] == 0x00ff0000 && masks[1] == 0x0000ff00 && masks[2] == 0x000000ff;
+        }
+
+        // Copy the first channel of the current image into a single channel plane.
+        GrayPlane extractPlane() {
+            GrayPlane plane;
+            plane.width = width;
+            plane.height = height;
+            plane.pixels.resize(size_t(width) * height);
+            for (int32_t i = 0; i < height; i++) {
+                uint8_t * dst = plane.row(i);
+                const char * src = currentImgData[i];
+                for (int32_t j = 0; j < width; j++) {
+                    dst[j] = uint8_t(src[size_t(j) * 3]);
+                }
+            }
+            return plane;
+        }
+
+        // Write a single channel plane to all three channels of the current image.
+        void fillRows(GrayPlane & plane) {
+            currentImgData.resize(width, height);
+            for (int32_t i = 0; i < height; i++) {
+                const uint8_t * src = plane.row(i);
+                char * dst = currentImgData[i];
+                for (int32_t j = 0; j < width; j++) {
+                    dst[size_t(j) * 3] = char(src[j]);
+                    dst[(size_t(j) * 3) + 1] = char(src[j]);
+                    dst[(size_t(j) * 3) + 2] = char(src[j]);
+                }
+            }
+            return;
+        }
+
+        // Replace the current image with a single channel plane.
+        void storePlane(GrayPlane & plane) {
+            fillRows(plane);
+            setHistogram();
+            return;
+        }
+
+        // Open bitmap file and read the contents.
+        bool openFile(std::string filename) {
+            std::ifstream imageFile;
+            imageFile.open(filename, std::ios::in | std::ios::binary);
+            
+            // Ensure file was opened succesfully.
+            if(!imageFile.is_open()) {
+                std::cout << "Unable to open file." << std::endl;
+                return false;
+            }
+
+            return readImage(imageFile);
+        }
+
+        // Open a bitmap held in a POSIX shared memory object and read the contents.
+        bool openShared(std::string name) {
+            int fd = shm_open(name.c_str(), O_RDONLY, 0);
+            struct stat info;
+            if (fd < 0 || fstat(fd, &info) != 0) {
+                std::cout << "Unable to open shared memory." << std::endl;
+                if (fd >= 0) {
+                    close(fd);
+                }
+                return false;
+            }
+
+            size_t size = info.st_size;
+            void * mapping = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            close(fd);
+            if (mapping == MAP_FAILED) {
+                std::cout << "Unable to open shared memory." << std::endl;
+                return false;
+            }
+
+            MemoryBuffer buffer(static_cast<const char *>(mapping), size);
+            std::istream imageStream(&buffer);
+            bool loaded = readImage(imageStream);
+            munmap(mapping, size);
+            return loaded;
+        }
+
+        // Bytes left in a stream from its current position, or -1 if it cannot seek.
+        static int64_t bytesLeft(std::istream & stream) {
+            std::streampos start = stream.tellg();
+            if (start == std::streampos(-1) || !stream.seekg(0, std::ios::end)) {
+                stream.clear();
+                return -1;
+            }
+            std::streampos end = stream.tellg();
+            stream.seekg(start);
+            return (end == std::streampos(-1)) ? -1 : int64_t(end - start);
+        }
+
+        // Read a bitmap from a stream and make it the current image.
+        bool readImage(std::istream & imageFile) {
+            // Start every image from a clean state, the object may be reused for many images.
+            skeletonComplete = false;
+            grayscaleLoaded = false;
+            grayscaleCached = false;
+            currentThreshold = -1;
+
+            /* Nothing is allocated for a size the header claims until it has been checked
+            against the bytes the stream actually holds. Headers are limited to MAX_HEADER_SIZE,
+            and only streams that cannot seek are limited to MAX_DIMENSION pixels a side. */
+            static constexpr size_t FILE_HEADER_SIZE = 14;
+            static constexpr uint32_t MAX_HEADER_SIZE = 1 << 20;
+            static constexpr int32_t MAX_DIMENSION = 1 << 16;
+            int64_t available = bytesLeft(imageFile);
+
+            // Read the file header and the size of the info header that follows it.
+            std::vector<char> header(FILE_HEADER_SIZE + 4);
+            imageFile.read(header.data(), header.size());
+
+            uint32_t infoSize = 0;
+            std::memcpy(&infoSize, &header[FILE_HEADER_SIZE], sizeof(infoSize));
+
+            // Read the info header (40, 108 or 124 bytes) and any bit masks or palette up to the pixels.
+            uint32_t dataOffset = 0;
+            std::memcpy(&dataOffset, &header[10], sizeof(dataOffset));
+            if (!imageFile || infoSize < 40 || dataOffset < FILE_HEADER_SIZE + uint64_t(infoSize) ||
+                dataOffset > MAX_HEADER_SIZE || (available >= 0 && dataOffset > available)) {
+                std::cout << "Unsupported bitmap format." << std::endl;
+                return false;
+            }
+            header.resize(dataOffset);
+            imageFile.read(header.data() + FILE_HEADER_SIZE + 4, header.size() - (FILE_HEADER_SIZE + 4));
+
+            BitmapInfo info;
+            if (!imageFile || !parseHeader(header, info)) {
+                std::cout << "Unsupported bitmap format." << std::endl;
+                return false;
+            }
+
+            /* The pixel array of any depth, 8 bpp included, has to fit in what is left of a
+            stream that can seek. Every side leaves room for the border thinning adds. */
+            bool tooLarge = (available < 0) ? (info.width > MAX_DIMENSION || info.height > MAX_DIMENSION) :
+                            (info.rowStride * info.height > uint64_t(available - dataOffset));
+            if (tooLarge || info.width > INT32_MAX - 2 || info.height > INT32_MAX - 2) {
+                std::cout << "Unable to read image data." << std::endl;
+                return false;
+            }
+
+            // The palette sits between the info header and the pixels, 4 bytes per entry.
+            if (info.bitsPerPixel == 8) {
+                uint32_t coloursUsed = 0;
+                std::memcpy(&coloursUsed, &header[46], sizeof(coloursUsed));
+                size_t paletteStart = FILE_HEADER_SIZE + info.infoSize;
+                size_t entries = std::min<size_t>(coloursUsed == 0 ? 256 : coloursUsed, (dataOffset - paletteStart) / 4);
+                info.palette.resize(entries);
+                std::memcpy(info.palette.data(), &header[paletteStart], entries * 4);
+            }
+
+            setHeader(header, info);
+
+            /* Read the pixel array in chunks of whole rows, so only one chunk of the file is
+            held in memory and no single read is larger than READ_CHUNK. The pooled chunk
+            buffer is 64-byte aligned for 32 bpp loads. */
+            static constexpr size_t READ_CHUNK = size_t(64) << 20;
+            int32_t chunkRows = int32_t(std::max<size_t>(1, std::min<size_t>(READ_CHUNK / info.rowStride, height)));
+            PoolBuffer<char> & pixels = fileScratch;
+            pixels.resize(info.rowStride * chunkRows);
+            uint64_t key = (cache != nullptr) ? ResultCache::layoutKey(info) : 0;
+            auto readChunks = [&](bool hash, bool decode) {
+                for (int32_t firstRow = 0; firstRow < height; firstRow += chunkRows) {
+                    int32_t rows = std::min(chunkRows, height - firstRow);
+                    size_t chunkSize = info.rowStride * rows;
+                    imageFile.read(pixels.data(), chunkSize);
+                    if (size_t(imageFile.gcount()) != chunkSize) {
+                        std::cout << "Unable to read image data." << std::endl;
+                        return false;
+                    }
+                    if (hash) {
+                        key = ResultCache::addToKey(key, pixels.data(), chunkSize);
+                    }
+                    if (decode) {
+                        decodeChunk(pixels.data(), firstRow, rows, info);
+                    }
+                }
+                return true;
+            };
+
+            // A cached grayscale plane for the same pixels replaces decoding and the grayscale conversion.
+            int32_t targetWidth;
+            int32_t targetHeight;
+            Resampler::targetSize(resizeOptions, width, height, targetWidth, targetHeight);
+            bool resizing = targetWidth != width || targetHeight != height;
+            auto loadCached = [&]() {
+                inputKey = resizing ? ResultCache::resizeKey(key, resizeOptions) : key;
+                GrayPlane plane;
+                if (!cache->loadGray(inputKey, plane, currentHist, currentThreshold) ||
+                    plane.width != targetWidth || plane.height != targetHeight) {
+                    return false;
+                }
+                width = targetWidth;
+                height = targetHeight;
+                fillRows(plane);
+                grayscaleCached = true;
+                return true;
+            };
+
+            /* With a cache, a stream that can seek is hashed before anything is decoded and is
+            only read again to decode it when the lookup misses. Other streams are hashed and
+            decoded in the same pass. */
+            std::streampos pixelStart = imageFile.tellg();
+            bool hashFirst = cache != nullptr && available >= 0 && pixelStart != std::streampos(-1);
+            if (hashFirst) {
+                if (!readChunks(true, false)) {
+                    return false;
+                }
+                if (loadCached()) {
+                    return true;
+                }
+                if (!imageFile.seekg(pixelStart)) {
+                    std::cout << "Unable to read image data." << std::endl;
+                    return false;
+                }
+            }
+            currentImgData.resize(width, height);
+            if (!readChunks(cache != nullptr && !hashFirst, true)) {
+                return false;
+            }
+            if (cache != nullptr && !hashFirst && loadCached()) {
+                return true;
+            }
+
+            setImg(info);
+            if (resizing && !resizeImage()) {
+                return false;
+            }
+            return true;
+        }
+
+        /* Resize the image that was just read, before any stage sees it. Grayscale images
+        only resize their one channel. Returns false if the resized image does not fit in memory. */
+        bool resizeImage() {
+            try {
+                if (grayscaleLoaded) {
+                    GrayPlane plane = extractPlane();
+                    Resampler::apply(plane, resizeOptions);
+                    width = plane.width;
+                    height = plane.height;
+                    storePlane(plane);
+                } else {
+                    Resampler::apply(currentImgData, width, height, resizeOptions);
+                }
+            } catch (const std::bad_alloc &) {
+                std::cout << "Unable to resize image." << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        // Where an output file is written, with the output directory and prefix applied.
+        std::string outputPath(std::string filename) {
+            filename = outputPrefix + filename;
+            if (!outputDirectory.empty()) {
+                filename = outputDirectory + "/" + filename;
+            }
+            return filename;
+        }
+
+        // Writes a bitmap image to a specified file name.
+        void writeFile(std::string filename) {
+            // Rows are stored as BGR triples, already padded to a multiple of 4 bytes like the file.
+            size_t rowStride = currentImgData.stride();
+
+            /* Build the header in a small buffer and update the size fields for the current image.
+            The size fields are only 32 bits, files too large for them store 0, which readers
+            accept for uncompressed images. */
+            std::vector<char> header = currentImgHeader;
+            uint64_t fullImageSize = uint64_t(rowStride) * height;
+            uint64_t fullFileSize = header.size() + fullImageSize;
+            uint32_t imageSize = fullImageSize > UINT32_MAX ? 0 : uint32_t(fullImageSize);
+            uint32_t fileSize = fullFileSize > UINT32_MAX ? 0 : uint32_t(fullFileSize);
+            std::memcpy(&header[2], &fileSize, sizeof(fileSize));
+            std::memcpy(&header[18], &width, sizeof(width));
+            std::memcpy(&header[22], &height, sizeof(height));
+            std::memcpy(&header[34], &imageSize, sizeof(imageSize));
+
+            /* Gather the header and the pixel rows straight from currentImgData, without copying
+            the pixels. The rows are split into WRITE_CHUNK pieces because a single write moves
+            at most about 2 GB. */
+            static constexpr size_t WRITE_CHUNK = size_t(1) << 30;
+            std::vector<struct iovec> iov;
+            iov.push_back({header.data(), header.size()});
+            for (size_t offset = 0; offset < currentImgData.bytes(); offset += WRITE_CHUNK) {
+                iov.push_back({currentImgData.data() + offset, std::min(WRITE_CHUNK, currentImgData.bytes() - offset)});
+            }
+
+            // Write to a temporary file and rename it so readers never see a partial image.
+            if (!writeAtomically(outputPath(filename), iov)) {
+                std::cout << "Unable to write to file." << std::endl;
+            }
+            return;
+        }
+
+        // Transform the pixels of a rectangle to their greyscale values.
+        void convertRect(PixelRect rect) {
+            for (int i = rect.y0; i < rect.y1; i++) {
+                char * img = currentImgData[i];
+                for (size_t j = size_t(rect.x0) * 3; j < (size_t(rect.x1) * 3); j += 3) {
+                    int grayValue = (int(img[j] & 0xff) * 0.0722) +
+                                (int(img[j+1] & 0xff) * 0.7152) +
+                                (int(img[j+2] & 0xff) * 0.2126);
+                    img[j] = grayValue;
+                    img[j+1] = grayValue;
+                    img[j+2] = grayValue;
+                }
+            }
+            return;
+        }
+
+        // Add the first channel of a rectangle to a histogram, or take it away.
+        static void countRect(ImageRows & rows, PixelRect rect, std::vector<uint64_t> & hist, bool remove) {
+            for (int32_t i = rect.y0; i < rect.y1; i++) {
+                const char * row = rows[i];
+                for (size_t j = size_t(rect.x0) * 3; j < size_t(rect.x1) * 3; j += 3) {
+                    if (remove) {
+                        hist[int(row[j] & 0xff)]--;
+                    } else {
+                        hist[int(row[j] & 0xff)]++;
+                    }
+                }
+            }
+        }
+
+        // True if the pixels of a rectangle differ between two images of the same size.
+        static bool rectsDiffer(ImageRows & first, ImageRows & second, PixelRect rect) {
+            size_t offset = size_t(rect.x0) * 3;
+            size_t length = size_t(rect.x1 - rect.x0) * 3;
+            for (int32_t i = rect.y0; i < rect.y1; i++) {
+                if (std::memcmp(first[i] + offset, second[i] + offset, length) != 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Hash the raw pixels of each tile and mark the tiles that changed since the previous frame.
+        void compareTiles() {
+            FrameHistory & frames = *history;
+            if (frames.width != width || frames.height != height) {
+                frames.setLayout(width, height);
+            }
+
+            // Bands of tile rows are hashed in parallel, each pixel row adds its run to every tile it crosses.
+            static constexpr int32_t TILE_SIZE = FrameHistory::TILE_SIZE;
+            std::vector<uint64_t> hashes(frames.tileCount());
+            for (size_t i = 0; i < hashes.size(); i++) {
+                hashes[i] = i;
+            }
+            parallelFor(size_t(frames.tilesY), 1, [&](size_t begin, size_t end) {
+                for (size_t tileRow = begin; tileRow < end; tileRow++) {
+                    int32_t lastRow = std::min(int32_t(tileRow + 1) * TILE_SIZE, height);
+                    for (int32_t y = int32_t(tileRow) * TILE_SIZE; y < lastRow; y++) {
+                        const char * row = currentImgData[y];
+                        for (int32_t tileColumn = 0; tileColumn < frames.tilesX; tileColumn++) {
+                            size_t index = (tileRow * frames.tilesX) + tileColumn;
+                            int32_t x0 = tileColumn * TILE_SIZE;
+                            int32_t x1 = std::min(x0 + TILE_SIZE, width);
+                            hashes[index] = hashBytes(row + (size_t(x0) * 3), size_t(x1 - x0) * 3, hashes[index]);
+                        }
+                    }
+                }
+            });
+
+            frames.grayTilesChanged = 0;
+            for (size_t i = 0; i < hashes.size(); i++) {
+                frames.grayDirty[i] = !frames.grayValid || hashes[i] != frames.tileHashes[i];
+                frames.grayTilesChanged += frames.grayDirty[i];
+            }
+            frames.tileHashes.swap(hashes);
+            return;
+        }
+
+        /* Convert only the tiles that changed since the previous frame and copy the rest from
+        its grayscale image. The previous histogram is updated for the changed tiles. */
+        void convertChangedTiles() {
+            FrameHistory & frames = *history;
+            currentHist = frames.grayHist;
+            for (size_t i = 0; i < frames.tileCount(); i++) {
+                PixelRect rect = frames.tile(i);
+                if (frames.grayDirty[i]) {
+                    countRect(frames.gray, rect, currentHist, true);
+                    convertRect(rect);
+                    countRect(currentImgData, rect, currentHist, false);
+                } else {
+                    currentImgData.copyRect(frames.gray, rect.x0, rect.y0, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0);
+                }
+            }
+            return;
+        }
+
+        // Keep the grayscale image for the next frame, copying only the tiles that changed.
+        void recordGray() {
+            FrameHistory & frames = *history;
+            if (!frames.grayValid) {
+                frames.gray.copyFrom(currentImgData);
+            } else {
+                for (size_t i = 0; i < frames.tileCount(); i++) {
+                    if (frames.grayDirty[i]) {
+                        PixelRect rect = frames.tile(i);
+                        frames.gray.copyRect(currentImgData, rect.x0, rect.y0, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0);
+                    }
+                }
+            }
+            frames.grayHist = currentHist;
+            frames.grayValid = true;
+            return;
+        }
+
+        /* Keep the previous frame's threshold while the histogram stays close to the one it
+        was computed from. The distance is the fraction of pixels that would have to move to
+        another level to turn one histogram into the other, from 0 to 1. */
+        int sequenceThreshold() {
+            FrameHistory & frames = *history;
+            frames.thresholdReused = false;
+            if (frames.threshold >= 0 && frames.thresholdHist.size() == currentHist.size()) {
+                uint64_t total = 0;
+                uint64_t previousTotal = 0;
+                for (size_t i = 0; i < currentHist.size(); i++) {
+                    total += currentHist[i];
+                    previousTotal += frames.thresholdHist[i];
+                }
+                double distance = 0;
+                for (size_t i = 0; i < currentHist.size() && total > 0 && previousTotal > 0; i++) {
+                    distance += std::fabs((double(currentHist[i]) / total) - (double(frames.thresholdHist[i]) / previousTotal));
+                }
+                if (total > 0 && previousTotal > 0 && distance / 2 <= frames.histogramTolerance) {
+                    frames.thresholdReused = true;
+                    return frames.threshold;
+                }
+            }
+            frames.threshold = otsuThreshold();
+            frames.thresholdHist = currentHist;
+            return frames.threshold;
+        }
+
+        // Convert the newly opened image to grayscale and write "grayscale.bmp".
+        void convertGrayscale() {
+            if (history != nullptr) {
+                compareTiles();
+            }
+
+            // Grayscale 8 bpp images and cached planes need no conversion.
+            if (grayscaleCached) {
+                std::cout << "Grayscale loaded from cache." << std::endl;
+            } else if (!grayscaleLoaded) {
+                if (history != nullptr && history->grayValid) {
+                    convertChangedTiles();
+                } else {
+                    convertRect({0, 0, width, height});
+                    setHistogram();
+                }
+            }
+            if (history != nullptr) {
+                recordGray();
+            }
+
+            if (!grayscaleCached) {
+                currentThreshold = (history != nullptr) ? sequenceThreshold() : otsuThreshold();
+                if (cache != nullptr) {
+                    cache->storeGray(inputKey, extractPlane(), currentHist, currentThreshold);
+                }
+            }
+            
+            // Write the greyscale image to "grayscale.bmp".
+            writeFile("grayscale.bmp");
+            std::cout << "Grayscale Image created. " << std::endl;
+            return;
+        }
 
-            for (int i = 0; i < height; i++) {
-                currentImgData[i].resize(width * 3);
-                for (int j = 0; j < (width * 3); j++) {
-                    currentImgData[i][j] = img[index++];
+        // Set the pixels of a rectangle to background or foreground around the threshold.
+        void applyThreshold(int threshold, PixelRect rect) {
+            for(int i = rect.y0; i < rect.y1; i++) {
+                char * img = currentImgData[i];
+                for(size_t j = size_t(rect.x0) * 3; j < (size_t(rect.x1) * 3); j += 3){
+                    if (int(img[j] & 0xff) <= threshold) {
+                        img[j] = 0x00;
+                        img[j+1] = 0x00;
+                        img[j+2] = 0x00;
+                    } else {
+                        img[j] = 0xff;
+                        img[j+1] = 0xff;
+                        img[j+2] = 0xff;
+                    }
                 }
             }
-            setHistogram();
             return;
         }
 
-        // Creates the histogram of an image
-        void setHistogram() {
-            std::vector< std::vector<char> > img = currentImgData;
-            std::vector<int> hist(256);
+        /* Build the binary image from the previous frame's when possible, returns false if it
+        has to be made from scratch. With the same threshold unchanged grayscale tiles give
+        unchanged binary tiles, and changed tiles can be thresholded on their own as long as
+        no smoothing, cleanup step or adaptive window reaches across tiles. */
+        bool binaryFromHistory(const ThresholdOptions & thresholdOptions, const SmoothingOptions & smoothing,
+                               const std::vector<MorphStep> & cleanup) {
+            FrameHistory & frames = *history;
+            bool otsu = thresholdOptions.method == ThresholdMethod::Otsu;
+            if (!frames.binaryValid || (otsu && frames.binaryThreshold != currentThreshold)) {
+                return false;
+            }
+            if (frames.grayTilesChanged == 0) {
+                currentImgData.copyFrom(frames.binary);
+                return true;
+            }
+            if (!otsu || smoothing.filter != SmoothFilter::None || !cleanup.empty()) {
+                return false;
+            }
 
-            for (int i = 0; i < img.size(); i++) {
-                for (int j = 0; j < img[i].size(); j += 3){
-                    hist[int(img[i][j] & 0xff)]++;
+            for (size_t i = 0; i < frames.tileCount(); i++) {
+                PixelRect rect = frames.tile(i);
+                if (frames.grayDirty[i]) {
+                    applyThreshold(currentThreshold, rect);
+                } else {
+                    currentImgData.copyRect(frames.binary, rect.x0, rect.y0, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0);
                 }
             }
+            return true;
+        }
 
-            currentHist = hist;
-
+        // Mark the tiles whose binary pixels changed and keep the binary image for the next frame.
+        void recordBinary() {
+            FrameHistory & frames = *history;
+            frames.binaryTilesChanged = 0;
+            for (size_t i = 0; i < frames.tileCount(); i++) {
+                PixelRect rect = frames.tile(i);
+                frames.binaryDirty[i] = !frames.binaryValid || rectsDiffer(frames.binary, currentImgData, rect);
+                if (frames.binaryDirty[i] && frames.binaryValid) {
+                    frames.binary.copyRect(currentImgData, rect.x0, rect.y0, rect.x0, rect.y0, rect.x1 - rect.x0, rect.y1 - rect.y0);
+                }
+                frames.binaryTilesChanged += frames.binaryDirty[i];
+            }
+            if (!frames.binaryValid) {
+                frames.binary.copyFrom(currentImgData);
+            }
+            frames.binaryThreshold = currentThreshold;
+            frames.binaryValid = true;
             return;
         }
 
-        // Retrieves a threshold value using Otsu's method.
-        int otsuThreshold() {
-            
-            // Set histogram and total number of pixels.
-            std::vector<int> hist = currentHist;
-            int total = height * width;
+        /* Thin again only the tiles whose binary pixels changed and the tiles within the halo
+        of them, starting from the previous frame's skeleton. Each group of neighbouring tiles
+        is thinned as one window of the binary image with another halo of context around it,
+        and only the group's own tiles are copied back. Each pass applies eight masks one
+        after the other, so the context missing outside the window can reach MASK_REACH
+        pixels further in per pass, and a window is only exact if it converges in fewer than
+        halo / MASK_REACH passes. The first halo tried is wide enough for the passes the
+        previous frame needed, a window that needs more is thinned again with twice the
+        halo. Once a window would cover a quarter of the frame the whole frame is thinned
+        instead. A run stopped by its limits leaves the rest of the windows unthinned. */
+        void thinChangedTiles(const ThinningLimits & limits, std::chrono::steady_clock::time_point start, ThinningReport & report) {
+            FrameHistory & frames = *history;
+            static constexpr int32_t TILE_SIZE = FrameHistory::TILE_SIZE;
+            static constexpr int32_t MASK_REACH = FrameHistory::MASK_REACH;
+            int32_t haloTiles = (frames.halo + TILE_SIZE - 1) / TILE_SIZE;
 
-            // Retrieve sum value to compute average foreground value
-            double sum = 0;
-            for(int i=0; i < 256; i++) {
-                sum += i * hist[i];
+            // Grow the changed tiles by the halo.
+            std::vector<char> thin(frames.tileCount(), 0);
+            for (size_t i = 0; i < frames.tileCount(); i++) {
+                if (!frames.binaryDirty[i]) {
+                    continue;
+                }
+                int32_t tileColumn = int32_t(i % frames.tilesX);
+                int32_t tileRow = int32_t(i / frames.tilesX);
+                for (int32_t y = std::max(tileRow - haloTiles, 0); y <= std::min(tileRow + haloTiles, frames.tilesY - 1); y++) {
+                    for (int32_t x = std::max(tileColumn - haloTiles, 0); x <= std::min(tileColumn + haloTiles, frames.tilesX - 1); x++) {
+                        thin[(size_t(y) * frames.tilesX) + x] = 1;
+                    }
+                }
             }
 
-            // Initialize remaining variables
-            double sumBackground = 0;
-            long double weightBackground = 0;
-            long double weightForeground = 0;
-
-            double varMax = 0;
-            int threshold = 0;
-
-            for(int i=0; i < 256; i++) {
-                // Histogram value at current threshold added to background weight.
-                weightBackground += hist[i];
-                // If background weight = 0 continue to next iteration.
-                if(weightBackground == 0) {
+            frames.tilesThinned = 0;
+            std::vector<char> grouped(frames.tileCount(), 0);
+            std::vector<size_t> group;
+            ImageRows window;
+            for (size_t first = 0; first < frames.tileCount(); first++) {
+                if (!thin[first] || grouped[first]) {
                     continue;
                 }
 
-                // Foreground weight equals all the other pixels not located in the background.
-                weightForeground = total - weightBackground;
-                // If foreground weight = 0 then break out of the loop.
-                if (weightForeground == 0) {
-                    break;
+                // Collect the tiles connected to this one and their bounding box.
+                group.assign(1, first);
+                grouped[first] = 1;
+                PixelRect box = frames.tile(first);
+                for (size_t next = 0; next < group.size(); next++) {
+                    PixelRect rect = frames.tile(group[next]);
+                    box = {std::min(box.x0, rect.x0), std::min(box.y0, rect.y0), std::max(box.x1, rect.x1), std::max(box.y1, rect.y1)};
+                    int32_t tileColumn = int32_t(group[next] % frames.tilesX);
+                    int32_t tileRow = int32_t(group[next] / frames.tilesX);
+                    const int32_t steps[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+                    for (int32_t s = 0; s < 4; s++) {
+                        int32_t x = tileColumn + steps[s][0];
+                        int32_t y = tileRow + steps[s][1];
+                        size_t index = (size_t(y) * frames.tilesX) + x;
+                        if (x >= 0 && y >= 0 && x < frames.tilesX && y < frames.tilesY && thin[index] && !grouped[index]) {
+                            grouped[index] = 1;
+                            group.push_back(index);
+                        }
+                    }
                 }
-                
-                // calculate sum to find average background value.
-                sumBackground += i * hist[i];
 
-                // Calculate average values.
-                double averagerBackground = sumBackground / weightBackground;
-                double averageForeground = (sum - sumBackground) / weightForeground;
+                // Thin the group with a halo of context and a one pixel background border, growing the halo until it is wide enough.
+                int32_t halo = std::max({frames.halo, MASK_REACH, ((frames.passes - 1) * MASK_REACH) + 1});
+                int32_t x0;
+                int32_t y0;
+                while (true) {
+                    x0 = std::max(box.x0 - halo, 0);
+                    y0 = std::max(box.y0 - halo, 0);
+                    int32_t x1 = std::min(box.x1 + halo, width);
+                    int32_t y1 = std::min(box.y1 + halo, height);
+                    if (int64_t(x1 - x0) * (y1 - y0) * 4 >= int64_t(width) * height) {
+                        thinWholeFrame(limits, start, report);
+                        return;
+                    }
+                    int32_t windowWidth = (x1 - x0) + 2;
+                    int32_t windowHeight = (y1 - y0) + 2;
+                    window.resize(windowWidth, windowHeight);
+                    std::memset(window.data(), 0x00, window.bytes());
+                    window.copyRect(currentImgData, x0, y0, 1, 1, x1 - x0, y1 - y0);
 
-                // Calculate between variance.
-                double varBetween = weightBackground * weightForeground * 
-                                    (averagerBackground - averageForeground) *
-                                    (averagerBackground - averageForeground);
+                    // Passes past what the halo allows are not run, the window is retried with twice the halo instead.
+                    int32_t allowed = ((halo - 1) / MASK_REACH) + 1;
+                    ThinningLimits attemptLimits = limits;
+                    bool capped = limits.maxIterations == 0 || allowed < limits.maxIterations;
+                    if (capped) {
+                        attemptLimits.maxIterations = allowed;
+                    }
+                    ThinningReport attempt = report;
+                    thinImage(window, windowWidth, windowHeight, attemptLimits, start, attempt);
+                    if (!capped || attempt.stop != ThinningStop::Iterations) {
+                        report = attempt;
+                        break;
+                    }
+                    halo = std::min(halo * 2, std::max(width, height));
+                }
 
-                /* If between variance is greater than max variance then set new
-                threshold value and set max variance to the between variance. */ 
-                if (varBetween > varMax) {
-                    varMax = varBetween;
-                    threshold = i;
+                // The stored skeleton keeps the border too, so both are offset by one pixel.
+                for (size_t i = 0; i < group.size(); i++) {
+                    PixelRect rect = frames.tile(group[i]);
+                    frames.skeleton.copyRect(window, (rect.x0 - x0) + 1, (rect.y0 - y0) + 1, rect.x0 + 1, rect.y0 + 1,
+                                             rect.x1 - rect.x0, rect.y1 - rect.y0);
                 }
+                frames.tilesThinned += group.size();
             }
 
-            // Return threshold value.
-            return threshold;
-        }
-
-        void addImagePadding() {
-            // Create new row to insert at the top and bottom of image.
-            std::vector<char> newRow((width * 3), 0x00);
+            if (report.iterations > 0) {
+                frames.passes = report.iterations;
+            }
 
-            // Set new height and width in image header.
+            // Continue with the skeleton and its border, as addImagePadding would leave it.
+            currentImgData.copyFrom(frames.skeleton);
             width = width + 2;
             height = height + 2;
-            currentImgHeader[18] = width;
-            currentImgHeader[22] = height;
-
-            // Insert padding rows to the top and bottom of image.
-            currentImgData.insert(currentImgData.begin(), newRow);
-            currentImgData.push_back(newRow);
+            return;
+        }
 
-            // Insert padding to both sides of the image.
-            for (int i = 0; i < currentImgData.size(); i++) {
+        // Thin the whole binary frame from scratch and keep its skeleton for the next frame.
+        void thinWholeFrame(const ThinningLimits & limits, std::chrono::steady_clock::time_point start, ThinningReport & report) {
+            addImagePadding();
+            thinImage(currentImgData, width, height, limits, start, report);
+            if (history != nullptr) {
+                history->skeleton.copyFrom(currentImgData);
+                history->skeletonValid = true;
+                history->tilesThinned = history->tileCount();
+                history->passes = report.iterations;
+            }
+            return;
+        }
 
-                currentImgData[i].push_back(0x00);
-                currentImgData[i].push_back(0x00);
-                currentImgData[i].push_back(0x00);
+    public:
+        // Create a greyscale version of the bitmap image.
+        bool createGrayscale(std::string filename) {
+            
+            // Ensure data was loaded.
+            if (!openFile(filename)) {
+                return false;
+            }
 
-                currentImgData[i].insert(currentImgData[i].begin(), 0x00);
-                currentImgData[i].insert(currentImgData[i].begin() + 1, 0x00);
-                currentImgData[i].insert(currentImgData[i].begin() + 2, 0x00);
+            convertGrayscale();
+            return true;
+        }
 
-                while(currentImgData[i].size() % 4 != 0) {
-                    currentImgData[i].push_back(0x00);
-                }
+        // Create a greyscale version of a bitmap held in shared memory.
+        bool createGrayscaleShared(std::string name) {
+            if (!openShared(name)) {
+                return false;
             }
+
+            convertGrayscale();
+            return true;
+        }
+
+        // Write the output images to this directory instead of the working directory.
+        void setOutputDirectory(std::string directory) {
+            outputDirectory = directory;
             return;
         }
 
-        void applyMask(std::vector< std::vector<int> > mask) {
+        // Start the names of the output images with this prefix.
+        void setOutputPrefix(std::string prefix) {
+            outputPrefix = prefix;
+            return;
+        }
 
-            bool fit = true;
+        // Reuse the results of the previous frame, or nullptr to treat every image on its own.
+        void setHistory(FrameHistory * frameHistory) {
+            history = frameHistory;
+            return;
+        }
 
-            std::vector< std::vector<char> > img = currentImgData;
-            
-            // Iterate through each pixel.
-            for (int i = 0; i < img.size(); i++) {
-                for (int j = 0; j < img[i].size(); j += 3) {
-                    
-                    // Don't apply mask to the padding around the border.
-                    if ( i == 0 || i == (img.size() - 1) || j == 0 || j == (img[i].size() - 1 )){
-                        continue;
-                    }
-                    
-                    // Iterate through each mask element.
-                    if (int(img[i][j] & 0xff) == 255) {
-                        fit = true;
-                        for (int x = 0; x < mask.size(); x++) {
-                            for (int y = 0; y < mask[x].size(); y ++) {
-                                // Find the index for the corresponding pixel value.
-                                int index1 = i + (x - 1);
-                                int index2 = j + ((y - 1) * 3);
-                                if (mask[x][y] != 1) {
-                                    // Compare mask value with corresponding pixel value.
-                                    if (int(currentImgData[index1][index2] & 0xff) != mask[x][y]){
-                                        // If mask doesn't fit, break from loop.
-                                        fit = false;
-                                        break;
-                                    }
-                                }
+        // Resize every image read from now on, a default ResizeOptions keeps them at their own size.
+        void setResize(const ResizeOptions & options) {
+            resizeOptions = options;
+            return;
+        }
 
-                            }
-                            if (!fit) {
-                                break;
-                            }
-                        }
-                        // If mask fits set pixel to background.
-                        if (fit) {
-                            img[i][j] = 0x00;
-                            img[i][j+1] = 0x00;
-                            img[i][j+2] = 0x00;
-                        }
-                    }
-                }
-            }
-            // Set current image data to resulting image.
-            currentImgData = img;
+        // Use a cache for the grayscale and binary stages.
+        void setCache(ResultCache * resultCache) {
+            cache = resultCache;
             return;
         }
 
-        void thinningItr() {
-            // Create masks to apply to each individual pixel.
-            std::vector< std::vector<int> > structEl1 = {{0,0,0}, 
-                                                         {1,255,1},
-                                                         {255,255,255}};
+        // Smooth the currently sotred image, create a binary version of it, then apply the cleanup steps.
+        void createBinary(const ThresholdOptions & thresholdOptions, const SmoothingOptions & smoothing,
+                          const std::vector<MorphStep> & cleanup) {
+            uint64_t binaryKey = ResultCache::binaryKey(inputKey, thresholdOptions, smoothing, cleanup);
+            GrayPlane cached;
+            if (cache != nullptr && cache->loadBinary(binaryKey, cached) &&
+                cached.width == width && cached.height == height) {
+                storePlane(cached);
+                writeFile("binary.bmp");
+                std::cout << "Binary image loaded from cache.\n";
+                return;
+            }
 
-            std::vector< std::vector<int> > structEl2 = {{1,0,0},
-                                                         {255,255,0},
-                                                         {1,255,1}};
+            // Frames of a sequence start from the previous frame's binary image where they can.
+            if (history == nullptr || !binaryFromHistory(thresholdOptions, smoothing, cleanup)) {
+                // Smooth out speckle first, the Otsu threshold then comes from the smoothed histogram.
+                int threshold = currentThreshold;
+                if (smoothing.filter != SmoothFilter::None) {
+                    GrayPlane plane = extractPlane();
+                    Smoothing::apply(plane, smoothing);
+                    storePlane(plane);
+                    threshold = -1;
+                }
 
-            std::vector< std::vector<int> > structEl3 = {{255,1,0}, 
-                                                         {255,255,0},
-                                                         {255,1,0}};
-                                                         
-            std::vector< std::vector<int> > structEl4 = {{1,255,1},
-                                                         {255,255,0},
-                                                         {1,0,0}};
+                if (thresholdOptions.method != ThresholdMethod::Otsu) {
+                    // Unevenly lit images are thresholded against the window around each pixel.
+                    GrayPlane plane = extractPlane();
+                    AdaptiveThreshold::apply(plane, thresholdOptions);
+                    fillRows(plane);
+                } else {
+                    // Retrieve threshold value from otsuThreshold() and set binary values based on it.
+                    threshold = threshold >= 0 ? threshold : otsuThreshold();
+                    applyThreshold(threshold, {0, 0, width, height});
+                }
 
-            std::vector< std::vector<int> > structEl5 = {{255,255,255}, 
-                                                         {1,255,1},
-                                                         {0,0,0}};
-                                                         
-            std::vector< std::vector<int> > structEl6 = {{1,255,1},
-                                                         {0,255,255},
-                                                         {0,0,1}};
+                // Clean up the binary image before it is thinned.
+                for (size_t i = 0; i < cleanup.size(); i++) {
+                    applyMorphology(cleanup[i].op, cleanup[i].element);
+                }
+            }
+            if (history != nullptr) {
+                recordBinary();
+            }
+            if (cache != nullptr) {
+                cache->storeBinary(binaryKey, extractPlane());
+            }
 
-            std::vector< std::vector<int> > structEl7 = {{0,1,255}, 
-                                                         {0,255,255},
-                                                         {0,1,255}};
-                                                         
-            std::vector< std::vector<int> > structEl8 = {{0,0,1},
-                                                         {0,255,255},
-                                                         {1,255,1}};
+            // Write image data to "binary.bmp".
+            writeFile("binary.bmp");
+            std::cout << "Binary image created.\n";
+            return;
+        }
 
-            // Create an original copy of the image.
-            std::vector< std::vector<char> > original = currentImgData;
-            
-            // Apply all the mask to each pixel.
-            applyMask(structEl1);
-            applyMask(structEl2);
-            applyMask(structEl3);
-            applyMask(structEl4);
-            applyMask(structEl5);
-            applyMask(structEl6);
-            applyMask(structEl7);
-            applyMask(structEl8);
-
-            // If the orignal image is the same as the new image set skeleton to complete.
-            if (original == currentImgData) {
-                skeletonComplete = true;
-            }
+        // Apply an opening, closing, erosion or dilation to the currently stored image.
+        void applyMorphology(MorphOp op, StructuringElement element) {
+            GrayPlane plane = extractPlane();
+            Morphology::apply(plane, op, element);
+            storePlane(plane);
             return;
         }
 
-        // Open bitmap file and read the contents.
-        std::vector<char> openFile(std::string filename) {
-            std::ifstream imageFile;
-            imageFile.open(filename, std::ios::in | std::ios::binary);
-            
-            // Ensure file was opened succesfully.
-            if(!imageFile.is_open()) {
-                std::cout << "Unable to open file." << std::endl;
-                return {};
+        /* Create a skeleton version of the currently stored binary image. Thinning stops early
+        if it reaches one of the limits in skeletonOptions, the partly thinned image is then
+        written as the result. Returns how the thinning went. */
+        ThinningReport createSkeleton(const SkeletonOptions & skeletonOptions) {
+            std::cout << "Creating skeleton...\n";
+            ThinningReport report;
+            auto start = std::chrono::steady_clock::now();
+            if (history != nullptr && history->skeletonValid) {
+                // Frames of a sequence only thin the tiles that changed.
+                thinChangedTiles(skeletonOptions.limits, start, report);
+            } else {
+                // Add padding around the border of the image and thin it until a skeleton is created.
+                thinWholeFrame(skeletonOptions.limits, start, report);
+            }
+            if (report.stop != ThinningStop::Converged) {
+                std::cout << "Thinning stopped after " << report.iterations << " passes: " << stopName(report.stop) << ".\n";
+                // The next frame cannot build on an unfinished skeleton.
+                if (history != nullptr) {
+                    history->skeletonValid = false;
+                }
+            }
+            // Prune after the skeleton is stored, so the next frame still thins from the full one.
+            if (skeletonOptions.pruneLength > 0) {
+                size_t pruned = SkeletonPruner::prune(currentImgData, width, height, skeletonOptions.pruneLength);
+                std::cout << "Pruned " << pruned << " spur pixels.\n";
+            }
+            // Write the resulting image to "skeleton.bmp", or its traced graph to "skeleton.json" or "skeleton.graph".
+            if (skeletonOptions.format == SkeletonFormat::Bitmap) {
+                writeFile("skeleton.bmp");
+            } else {
+                SkeletonGraph graph = SkeletonTracer::trace(currentImgData, width, height);
+                bool written = (skeletonOptions.format == SkeletonFormat::Json) ?
+                               SkeletonTracer::writeJson(graph, outputPath("skeleton.json")) :
+                               SkeletonTracer::writeBinary(graph, outputPath("skeleton.graph"));
+                if (!written) {
+                    std::cout << "Unable to write to file." << std::endl;
+                }
             }
+            std::cout << "Skeleton created.\n";
+            return report;
+        }
+};
 
-            // Read header data.
-            static constexpr size_t HEADER_SIZE = 54;
-            std::array<char, HEADER_SIZE> header;
+// Stages of the pipeline, each one needs the stages before it.
+enum class Stage { Grayscale = 1, Binary = 2, Skeleton = 3 };
 
-            imageFile.read(header.data(), header.size());
+// Options for a single run of the pipeline.
+struct PipelineOptions {
+    std::string inputFile = "";
+    std::string inputShared = "";
+    std::string outputDirectory = "";
+    std::string workingDirectory = "";
+    Stage lastStage = Stage::Skeleton;
+    ResizeOptions resize = {};
+    SmoothingOptions smoothing = {};
+    ThresholdOptions threshold = {};
+    std::vector<MorphStep> cleanup = {};
+    SkeletonOptions skeleton = {};
+    std::string cacheDirectory = "";
+    uint64_t cacheBytes = uint64_t(256) << 20;
 
-            auto dataOffset = *reinterpret_cast<uint32_t *>(&header[10]);
-            auto width = *reinterpret_cast<uint32_t *>(&header[18]);
-            auto height = *reinterpret_cast<uint32_t *>(&header[22]);
-            
-            std::cout << "original width: " << width << " : " << width*4 << std::endl;
+    bool printStats = false;
 
-            // Read remaining image file.
-            auto dataSize = (dataOffset + ((width * height) * 4));
-            std::vector<char> img(dataSize);
-            
-            imageFile.seekg(0, std::ios::beg);
-            imageFile.read(img.data(), img.size());
-            
-            imageFile.close();
+    // Sequence settings, only used with --sequence.
+    std::string sequencePattern = "";
+    int firstFrame = 0;
+    int32_t halo = 32;
+    double histogramTolerance = 0.01;
 
-            setImg(img);
-            return img;
+    // Server settings, only used with --serve.
+    std::string socketPath = "";
+    size_t workers = 0;
+    size_t queueCapacity = 64;
+};
+
+// Time spent in each stage of one pipeline run, in milliseconds, and how its thinning ended.
+struct StageTimings {
+    double grayscale = 0;
+    double binary = 0;
+    double skeleton = 0;
+    ThinningReport thinning = {};
+};
+
+/* Read a whole argument as an integer between low and high. Returns false for empty text,
+trailing characters or a value out of range, so a typo is rejected instead of read as 0. */
+bool parseInteger(const char * text, long long low, long long high, long long & value) {
+    long long parsed = 0;
+    char trailing = 0;
+    if (std::sscanf(text, "%lld%c", &parsed, &trailing) != 1 || parsed < low || parsed > high) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+// Read a whole argument as a number between low and high, with the same checks as parseInteger.
+bool parseDecimal(const char * text, double low, double high, double & value) {
+    double parsed = 0;
+    char trailing = 0;
+    if (std::sscanf(text, "%lf%c", &parsed, &trailing) != 1 || !(parsed >= low && parsed <= high)) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+// Read the stage list, the last stage named decides how far the pipeline runs.
+bool parseStages(const std::string & text, Stage & lastStage) {
+    int last = 0;
+    size_t start = 0;
+    while (start <= text.size()) {
+        size_t end = text.find(',', start);
+        std::string name = text.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        if (name == "grayscale") {
+            last = std::max(last, int(Stage::Grayscale));
+        } else if (name == "binary") {
+            last = std::max(last, int(Stage::Binary));
+        } else if (name == "skeleton") {
+            last = std::max(last, int(Stage::Skeleton));
+        } else {
+            return false;
         }
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    lastStage = Stage(last);
+    return last > 0;
+}
 
-        // Writes a bitmap image to a specified file name.
-        void writeFile(std::string filename) {
-            std::ofstream newImage;
-            newImage.open(filename, std::ios::out | std::ios::binary);
-            
-            // Ensure file was opened successfully.
-            if(!newImage.is_open()) {
-                std::cout << "Unable to write to file." << std::endl;
-                return;
+// Read the command line options, returns false if they are invalid.
+bool parseOptions(int argc, char * argv[], PipelineOptions & options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--open" || arg == "--close" || arg == "--erode" || arg == "--dilate") {
+            MorphStep step;
+            if (i + 1 >= argc || !Morphology::parseElement(argv[++i], step.element)) {
+                std::cout << arg << " expects rect:WxH, hline:L or vline:L." << std::endl;
+                return false;
+            }
+            if (arg == "--open") {
+                step.op = MorphOp::Open;
+            } else if (arg == "--close") {
+                step.op = MorphOp::Close;
+            } else if (arg == "--erode") {
+                step.op = MorphOp::Erode;
+            } else {
+                step.op = MorphOp::Dilate;
+            }
+            options.cleanup.push_back(step);
+        } else if (arg == "--threshold") {
+            if (i + 1 >= argc || !AdaptiveThreshold::parseOptions(argv[++i], options.threshold)) {
+                std::cout << arg << " expects otsu, sauvola[:WINDOW[:K]] or bradley[:WINDOW[:T]]." << std::endl;
+                return false;
+            }
+        } else if (arg == "--resize") {
+            if (i + 1 >= argc || !Resampler::parseOptions(argv[++i], options.resize)) {
+                std::cout << arg << " expects WIDTHxHEIGHT[:box|bilinear|lanczos] with sides up to 1048576." << std::endl;
+                return false;
+            }
+        } else if (arg == "--smooth") {
+            if (i + 1 >= argc || !Smoothing::parseOptions(argv[++i], options.smoothing)) {
+                std::cout << arg << " expects none, box[:RADIUS], gaussian[:SIGMA] with SIGMA from 0.58 to 50, or median." << std::endl;
+                return false;
+            }
+        } else if (arg == "--skeleton-format") {
+            if (i + 1 >= argc || !SkeletonTracer::parseFormat(argv[++i], options.skeleton.format)) {
+                std::cout << arg << " expects bmp, json or graph." << std::endl;
+                return false;
+            }
+        } else if (arg == "--prune") {
+            long long length = 0;
+            if (i + 1 >= argc || !parseInteger(argv[++i], 0, INT32_MAX, length)) {
+                std::cout << arg << " expects a length in pixels of 0 or more." << std::endl;
+                return false;
+            }
+            options.skeleton.pruneLength = int32_t(length);
+        } else if (arg == "--max-iterations") {
+            long long passes = 0;
+            if (i + 1 >= argc || !parseInteger(argv[++i], 0, INT32_MAX, passes)) {
+                std::cout << arg << " expects a number of passes of 0 or more." << std::endl;
+                return false;
+            }
+            options.skeleton.limits.maxIterations = int32_t(passes);
+        } else if (arg == "--deadline") {
+            if (i + 1 >= argc || !parseDecimal(argv[++i], 0, 1e12, options.skeleton.limits.deadlineMs)) {
+                std::cout << arg << " expects a time in milliseconds of 0 or more." << std::endl;
+                return false;
+            }
+        } else if (arg == "--min-removed") {
+            long long pixels = 0;
+            if (i + 1 >= argc || !parseInteger(argv[++i], 0, LLONG_MAX, pixels)) {
+                std::cout << arg << " expects a number of pixels of 0 or more." << std::endl;
+                return false;
+            }
+            options.skeleton.limits.minRemoved = size_t(pixels);
+        } else if (arg == "--progress") {
+            options.skeleton.limits.progress = [](const ThinningReport & report) {
+                char line[128];
+                std::snprintf(line, sizeof(line), "Thinning pass %d: %zu pixels removed, %.3f ms",
+                              report.iterations, report.lastRemoved, report.elapsedMs);
+                std::cout << line << std::endl;
+            };
+        } else if (arg == "--stages" && i + 1 < argc) {
+            if (!parseStages(argv[++i], options.lastStage)) {
+                std::cout << "--stages expects a list of grayscale, binary and skeleton." << std::endl;
+                return false;
+            }
+        } else if (arg == "--shm" && i + 1 < argc) {
+            options.inputShared = argv[++i];
+        } else if (arg == "--output-dir" && i + 1 < argc) {
+            options.outputDirectory = argv[++i];
+        } else if (arg == "--cwd" && i + 1 < argc) {
+            options.workingDirectory = argv[++i];
+        } else if (arg == "--cache" && i + 1 < argc) {
+            options.cacheDirectory = argv[++i];
+        } else if (arg == "--cache-size") {
+            // Sizes are given in megabytes, the bound keeps the conversion to bytes from overflowing.
+            long long megabytes = 0;
+            if (i + 1 >= argc || !parseInteger(argv[++i], 0, (long long)(std::min<uint64_t>(SIZE_MAX, LLONG_MAX) >> 20), megabytes)) {
+                std::cout << arg << " expects a size in megabytes of 0 or more." << std::endl;
+                return false;
+            }
+            options.cacheBytes = uint64_t(megabytes) << 20;
+        } else if (arg == "--stats") {
+            options.printStats = true;
+        } else if (arg == "--sequence" && i + 1 < argc) {
+            options.sequencePattern = argv[++i];
+        } else if (arg == "--first") {
+            long long first = 0;
+            if (i + 1 >= argc || !parseInteger(argv[++i], 0, INT32_MAX, first)) {
+                std::cout << arg << " expects a frame number of 0 or more." << std::endl;
+                return false;
             }
+            options.firstFrame = int(first);
+        } else if (arg == "--halo") {
+            long long halo = 0;
+            if (i + 1 >= argc || !parseInteger(argv[++i], FrameHistory::MASK_REACH, 65536, halo)) {
+                std::cout << arg << " expects a width in pixels from " << FrameHistory::MASK_REACH << " to 65536." << std::endl;
+                return false;
+            }
+            options.halo = int32_t(halo);
+        } else if (arg == "--hist-tolerance") {
+            if (i + 1 >= argc || !parseDecimal(argv[++i], 0, 1, options.histogramTolerance)) {
+                std::cout << arg << " expects a fraction between 0 and 1." << std::endl;
+                return false;
+            }
+        } else if (arg == "--serve" && i + 1 < argc) {
+            options.socketPath = argv[++i];
+        } else if (arg == "--workers") {
+            long long workers = 0;
+            if (i + 1 >= argc || !parseInteger(argv[++i], 0, 4096, workers)) {
+                std::cout << arg << " expects a number of workers from 0 to 4096, 0 uses one per core." << std::endl;
+                return false;
+            }
+            options.workers = size_t(workers);
+        } else if (arg == "--queue") {
+            long long capacity = 0;
+            if (i + 1 >= argc || !parseInteger(argv[++i], 1, 65536, capacity)) {
+                std::cout << arg << " expects a queue length from 1 to 65536." << std::endl;
+                return false;
+            }
+            options.queueCapacity = size_t(capacity);
+        } else if (arg.size() > 0 && arg[0] != '-' && options.inputFile.empty()) {
+            options.inputFile = arg;
+        } else {
+            std::cout << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
 
-            auto dataSize = (dataOffset + ((width * height) * 4));
-            std::vector<char> newImg(dataSize);
+// Resolve a relative path against the directory a job was submitted from.
+std::string resolvePath(const std::string & directory, const std::string & path) {
+    if (directory.empty() || path.empty() || path[0] == '/') {
+        return path;
+    }
+    return directory + "/" + path;
+}
 
-            std::copy(currentImgHeader.begin(), currentImgHeader.end(), newImg.begin());
+// Run the pipeline stages on an image, returns false if the input could not be loaded.
+bool runPipeline(Image & image, const PipelineOptions & options, StageTimings & timings) {
+    // Reuse earlier results when a cache directory is given.
+    std::unique_ptr<ResultCache> cache;
+    if (!options.cacheDirectory.empty()) {
+        cache.reset(new ResultCache(resolvePath(options.workingDirectory, options.cacheDirectory), options.cacheBytes));
+    }
+    image.setCache(cache.get());
+    image.setResize(options.resize);
 
-            int index = 0 + dataOffset;
-            std::vector< std::vector<char> > img = currentImgData;
-            for (int i = 0; i < img.size(); i++){
-                for (int j = 0; j < img[i].size(); j++){
-                    newImg[index++] = img[i][j];
-                }
-            }
-            
-            // Write image data to the file.
-            // std::cout << "Size: " << currentImgData.size() * currentImgData[0].size() << " : " << (((height * width) * 3)) << std::endl;
-            newImage.write(newImg.data(), newImg.size());
-            newImage.close();
-            return;
+    std::string outputDirectory = options.outputDirectory.empty() ? options.workingDirectory : options.outputDirectory;
+    image.setOutputDirectory(resolvePath(options.workingDirectory, outputDirectory));
+
+    // Create images in correct order.
+    auto start = std::chrono::steady_clock::now();
+    bool loaded = options.inputShared.empty() ?
+                  image.createGrayscale(resolvePath(options.workingDirectory, options.inputFile)) :
+                  image.createGrayscaleShared(options.inputShared);
+    timings.grayscale = elapsedMs(start);
+
+    if (loaded && options.lastStage >= Stage::Binary) {
+        start = std::chrono::steady_clock::now();
+        image.createBinary(options.threshold, options.smoothing, options.cleanup);
+        timings.binary = elapsedMs(start);
+    }
+    if (loaded && options.lastStage >= Stage::Skeleton) {
+        start = std::chrono::steady_clock::now();
+        timings.thinning = image.createSkeleton(options.skeleton);
+        timings.skeleton = elapsedMs(start);
+    }
+
+    // Scratch memory only lives for one job, the arena keeps its blocks for the next one.
+    image.setCache(nullptr);
+    Arena::forThread().reset();
+    return loaded;
+}
+
+/* Run the pipeline on numbered frames, reusing the unchanged parts of each frame in the
+next. The pattern holds a printf style int such as %04d, frames are read from firstFrame until one
+is missing, and each frame's outputs start with its file name. */
+int runSequence(Image & image, const PipelineOptions & options) {
+    FrameHistory history;
+    history.halo = options.halo;
+    history.histogramTolerance = options.histogramTolerance;
+    image.setHistory(&history);
+
+    // Tiles are compared with the previous frame rather than looked up in the cache.
+    PipelineOptions frameOptions = options;
+    frameOptions.cacheDirectory = "";
+
+    long frames = 0;
+    int result = 0;
+    for (int number = options.firstFrame; ; number++) {
+        char name[4096];
+        std::snprintf(name, sizeof(name), options.sequencePattern.c_str(), number);
+        if (access(resolvePath(options.workingDirectory, name).c_str(), R_OK) != 0) {
+            break;
         }
 
-    public:
-        // Create a greyscale version of the bitmap image.
-        void createGrayscale(std::string filename) {
-            
-            openFile(filename);
-            
-            std::vector< std::vector<char> > img = currentImgData;
+        // Name the outputs after the frame, "frame0001.bmp" writes "frame0001_skeleton.bmp".
+        std::string stem = name;
+        stem = stem.substr(stem.find_last_of('/') + 1);
+        stem = stem.substr(0, stem.find_last_of('.'));
+        image.setOutputPrefix(stem + "_");
 
-            // Ensure data was loaded.
-            if (img.size() == 0) {
-                return;
-            }
+        frameOptions.inputFile = name;
+        StageTimings timings;
+        auto start = std::chrono::steady_clock::now();
+        if (!runPipeline(image, frameOptions, timings)) {
+            result = 1;
+            break;
+        }
+        char line[256];
+        std::snprintf(line, sizeof(line), "Frame %d: %zu/%zu tiles changed, %zu binary tiles changed, %zu tiles thinned, threshold %s, %.3f ms",
+                      number, history.grayTilesChanged, history.tileCount(), history.binaryTilesChanged,
+                      history.tilesThinned, history.thresholdReused ? "reused" : "computed", elapsedMs(start));
+        std::cout << line << std::endl;
+        history.binaryTilesChanged = 0;
+        history.tilesThinned = 0;
+        frames++;
+        if (timings.thinning.stop == ThinningStop::Cancelled) {
+            break;
+        }
+    }
 
-            // Transform pixels to their greyscale values.
-            for (int i = 0; i < img.size(); i++) {
-                for (int j = 0; j < img[i].size(); j += 3) {
-                    int grayValue = (int(img[i][j] & 0xff) * 0.0722) +
-                                (int(img[i][j+1] & 0xff) * 0.7152) +
-                                (int(img[i][j+2] & 0xff) * 0.2126);
-                    img[i][j] = grayValue;
-                    img[i][j+1] = grayValue;
-                    img[i][j+2] = grayValue;
-                }
-            }
-            
-            // Write the greyscale image to "grayscale.bmp" and update the currently stored image.
-            currentImgData = img;
-            writeFile("grayscale.bmp");
-            std::cout << "Grayscale Image created. " << std::endl;
-            return;
+    image.setHistory(nullptr);
+    image.setOutputPrefix("");
+    if (frames == 0) {
+        std::cout << "No frames found for " << options.sequencePattern << "." << std::endl;
+        return 1;
+    }
+    return result;
+}
+
+// Describe buffer pool reuse and peak memory use as space separated key=value pairs.
+std::string memoryStats() {
+    BufferPool::Stats stats = BufferPool::shared().stats();
+    double reuse = stats.requests > 0 ? double(stats.reused) / stats.requests : 0;
+    char line[256];
+    std::snprintf(line, sizeof(line), "pool_requests=%llu pool_reuse=%.3f pool_peak_mb=%.1f pool_cached_mb=%.1f arena_peak_mb=%.1f",
+                  (unsigned long long) stats.requests, reuse, stats.peakBytesInUse / 1048576.0,
+                  stats.bytesCached / 1048576.0, Arena::forThread().peakBytes() / 1048576.0);
+    return line;
+}
+
+/* How long a client has to send its whole request. Each read also times out after this
+long through SO_RCVTIMEO, so an idle connection cannot hold a worker indefinitely. */
+static constexpr int REQUEST_TIMEOUT_MS = 5000;
+
+// Read one newline terminated request from a client, returns false on error, timeout or overlong requests.
+bool readRequest(int fd, std::string & request) {
+    static constexpr size_t MAX_REQUEST = 64 * 1024;
+    auto start = std::chrono::steady_clock::now();
+    char buffer[4096];
+    while (request.find('\n') == std::string::npos) {
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count <= 0 || request.size() + count > MAX_REQUEST || elapsedMs(start) > REQUEST_TIMEOUT_MS) {
+            return false;
         }
+        request.append(buffer, count);
+    }
+    request.resize(request.find('\n'));
+    return true;
+}
 
-        // Create a binary version of the currently sotred image.
-        void createBinary() {
-            // Retrieve threshold value from otsuThreshold().
-            int threshold = otsuThreshold();
-            std::vector< std::vector<char> > img = currentImgData;
+/* Run one job from a connected client. The request is a single line of tab separated
+command line options, the reply is a single line starting with "ok" or "error". Each
+worker thread keeps its own Image so its buffers stay allocated between jobs. A job that
+throws only fails that job, the worker goes on to the next connection. */
+void handleConnection(int fd, std::chrono::steady_clock::time_point accepted) {
+    static thread_local Image image;
+    double queueMs = elapsedMs(accepted);
+    std::string reply = "";
+    std::string request = "";
 
-            // Set binary values based on threshold value.
-            for(int i = 0; i < img.size(); i++) {
-                for(int j = 0; j < img[i].size(); j += 3){
-                    if (int(img[i][j] & 0xff) <= threshold) {
-                        img[i][j] = 0x00;
-                        img[i][j+1] = 0x00;
-                        img[i][j+2] = 0x00;
-                    } else {
-                        img[i][j] = 0xff;
-                        img[i][j+1] = 0xff;
-                        img[i][j+2] = 0xff;
-                    }
+    if (!readRequest(fd, request)) {
+        reply = "error unreadable request\n";
+    } else {
+        // Split the request into an argument list for parseOptions.
+        std::vector<std::string> args = {"skeleton"};
+        size_t start = 0;
+        while (start <= request.size()) {
+            size_t end = request.find('\t', start);
+            args.push_back(request.substr(start, end == std::string::npos ? std::string::npos : end - start));
+            if (end == std::string::npos) {
+                break;
+            }
+            start = end + 1;
+        }
+        std::vector<char *> argv;
+        for (size_t i = 0; i < args.size(); i++) {
+            argv.push_back(&args[i][0]);
+        }
+
+        try {
+            PipelineOptions options;
+            StageTimings timings;
+            auto jobStart = std::chrono::steady_clock::now();
+            if (!parseOptions(int(argv.size()), argv.data(), options) || !options.socketPath.empty() ||
+                !options.sequencePattern.empty()) {
+                reply = "error invalid options\n";
+            } else if (options.inputFile.empty() && options.inputShared.empty()) {
+                reply = "error no input given\n";
+            } else if (!runPipeline(image, options, timings)) {
+                reply = "error unable to load input\n";
+            } else {
+                char line[256];
+                std::snprintf(line, sizeof(line), "ok queue_ms=%.3f grayscale_ms=%.3f binary_ms=%.3f skeleton_ms=%.3f total_ms=%.3f",
+                              queueMs, timings.grayscale, timings.binary, timings.skeleton, elapsedMs(jobStart));
+                reply = line;
+                // Only a job that thinned has a thinning result to report.
+                if (options.lastStage >= Stage::Skeleton) {
+                    std::snprintf(line, sizeof(line), " thinning=%s passes=%d",
+                                  stopName(timings.thinning.stop), timings.thinning.iterations);
+                    reply += line;
                 }
+                if (options.printStats) {
+                    reply += " " + memoryStats();
+                }
+                reply += "\n";
             }
+        } catch (const std::exception & failure) {
+            reply = std::string("error ") + failure.what() + "\n";
+        }
+    }
 
-            // Write image data to "binary.bmp".
-            currentImgData = img;
-            writeFile("binary.bmp");
-            std::cout << "Binary image created.\n";
-            return;
+    size_t sent = 0;
+    while (sent < reply.size()) {
+        ssize_t count = write(fd, reply.data() + sent, reply.size() - sent);
+        if (count <= 0) {
+            break;
         }
+        sent += count;
+    }
+    close(fd);
+    return;
+}
 
-        // Create a skeleton version of the currently stored binary image.
-        void createSkeleton() {
-            std::cout << "Creating skeleton...\n";
-            // Add paddinng around the border of the image.
-            addImagePadding();
-            do {
-                // Thin the image until a skeleton is created.
-                thinningItr();
+/* Serve pipeline jobs on a Unix domain socket until the process is stopped. Accepted
+connections are queued on a thread pool, and when its queue is full the server stops
+accepting so new clients wait in the listen backlog. */
+int serve(const PipelineOptions & options) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (options.socketPath.size() >= sizeof(address.sun_path)) {
+        std::cout << "Socket path is too long." << std::endl;
+        return 1;
+    }
+    std::strncpy(address.sun_path, options.socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    // Replies to clients that have gone away must not stop the server.
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(options.socketPath.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+        listen(listener, int(options.queueCapacity)) != 0) {
+        std::cout << "Unable to listen on " << options.socketPath << "." << std::endl;
+        return 1;
+    }
+
+    size_t workers = options.workers > 0 ? options.workers : std::max(1u, std::thread::hardware_concurrency());
+    ThreadPool pool(workers, options.queueCapacity);
+    std::cout << "Serving on " << options.socketPath << " with " << pool.size() << " workers." << std::endl;
+
+    while (true) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            while (skeletonComplete == false);
-            // Write the resulting image to "skeleton.bmp".
-            writeFile("skeleton.bmp");
-            std::cout << "Skeleton created.\n";
-            return;
+            break;
         }
-};
+        auto accepted = std::chrono::steady_clock::now();
+        timeval timeout = {REQUEST_TIMEOUT_MS / 1000, (REQUEST_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        pool.submit([client, accepted] { handleConnection(client, accepted); });
+    }
+
+    close(listener);
+    unlink(options.socketPath.c_str());
+    return 1;
+}
+
+// Set by SIGINT to cancel the thinning of a command line run.
+static std::atomic<bool> interrupted(false);
+
+void stopThinning(int) {
+    interrupted = true;
+    signal(SIGINT, SIG_DFL);
+}
 
 // Main function
-int main() {
+int main(int argc, char * argv[]) {
     Image skeletonImg;
-    std::string fName = "";
+    PipelineOptions options;
 
-    // Retrieve image file name.
-    std::cout << "Enter image file name: ";
-    std::getline(std::cin, fName);
+    if (!parseOptions(argc, argv, options)) {
+        std::cout << "Usage: skeleton [--open|--close|--erode|--dilate ELEMENT]... [--smooth FILTER] [--threshold METHOD]\n"
+                  << "                [--stages LIST] [--resize WIDTHxHEIGHT[:FILTER]] [--skeleton-format bmp|json|graph] [--prune PIXELS]\n"
+                  << "                [--max-iterations N] [--deadline MS] [--min-removed PIXELS] [--progress]\n"
+                  << "                [--output-dir DIR] [--cache DIR] [--cache-size MB] [--stats] [--shm NAME | file]\n"
+                  << "       skeleton [OPTIONS] --sequence PATTERN [--first N] [--halo PIXELS] [--hist-tolerance FRACTION]\n"
+                  << "       skeleton --serve SOCKET [--workers N] [--queue N]" << std::endl;
+        return 1;
+    }
 
-    // Create images in correct order.
-    skeletonImg.createGrayscale(fName);
-    skeletonImg.createBinary();
-    skeletonImg.createSkeleton();
+    if (!options.socketPath.empty()) {
+        return serve(options);
+    }
+
+    // The first Ctrl-C stops thinning and keeps the partial skeleton, a second one exits.
+    signal(SIGINT, stopThinning);
+    options.skeleton.limits.cancel = &interrupted;
+
+    if (!options.sequencePattern.empty()) {
+        int result = runSequence(skeletonImg, options);
+        if (options.printStats) {
+            std::cout << memoryStats() << std::endl;
+        }
+        return result;
+    }
+
+    // Retrieve image file name if it was not given on the command line.
+    if (options.inputFile.empty() && options.inputShared.empty()) {
+        std::cout << "Enter image file name: ";
+        std::getline(std::cin, options.inputFile);
+    }
+
+    StageTimings timings;
+    if (!runPipeline(skeletonImg, options, timings)) {
+        return 1;
+    }
+    if (options.printStats) {
+        std::cout << memoryStats() << std::endl;
+    }
     return 0;
-}
\ No newline at end of file
+}
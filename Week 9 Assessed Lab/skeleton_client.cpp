@@ -0,0 +1,63 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <climits>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Sends one job to a skeleton server (skeleton --serve SOCKET) and prints the reply.
+The job options are the same as the skeleton command line, relative paths are
+resolved against the client's working directory. */
+int main(int argc, char * argv[]) {
+    if (argc < 3) {
+        std::cout << "Usage: skeleton_client SOCKET [job options]... file" << std::endl;
+        return 1;
+    }
+
+    // Build the request as one line of tab separated options.
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == nullptr) {
+        std::cout << "Unable to read the working directory." << std::endl;
+        return 1;
+    }
+    std::string request = std::string("--cwd\t") + directory;
+    for (int i = 2; i < argc; i++) {
+        request += "\t";
+        request += argv[i];
+    }
+    request += "\n";
+
+    // Connect to the server.
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        std::cout << "Unable to connect to " << argv[1] << "." << std::endl;
+        return 1;
+    }
+
+    // Send the request and print the reply.
+    size_t sent = 0;
+    while (sent < request.size()) {
+        ssize_t count = write(fd, request.data() + sent, request.size() - sent);
+        if (count <= 0) {
+            std::cout << "Unable to send request." << std::endl;
+            close(fd);
+            return 1;
+        }
+        sent += count;
+    }
+
+    std::string reply = "";
+    char buffer[256];
+    ssize_t count = 0;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+        reply.append(buffer, count);
+    }
+    close(fd);
+
+    std::cout << reply;
+    return reply.compare(0, 2, "ok") == 0 ? 0 : 1;
+}